@@ -12,6 +12,9 @@ function(add_exec_target CHAPTER)
 		src/blackboard.h
 		src/ConcurrentQueue.h
 		src/csp.h
+		src/csp_coro.h
+		src/csp_image.h
+		src/csp_shard.h
 		src/journal.h
 		src/TypedData.h
 		src/LabText.h
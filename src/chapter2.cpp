@@ -79,8 +79,22 @@
 ///
 /// CLOCK = (tick -> (tock -> CLOCK))
 ///
+/// or equivalently, with the parentheses left out,
+///
+/// CLOCK = (tick -> tock -> CLOCK)
+///
 /// tick and tock are CLOCK's alphabet.
 ///
+/// A process may offer a choice of events, in which case whichever occurs
+/// first decides the behavior that follows.
+///
+/// MACHINE = (coin -> (coffee -> MACHINE | tea -> MACHINE) | kick -> STOP)
+///
+/// Processes composed in parallel engage in the events they share together,
+/// so that a shared event only occurs once all of them are ready for it.
+///
+/// CAFE = MACHINE || CUSTOMER
+///
 /// Actions are considered to be instantaneous;
 /// since timing can be considered independently. There's no concept of simultaneity;
 /// if two events are considered to occur simultaneously, they are treated as a
@@ -124,7 +138,7 @@ void test_csp()
     /// emit some events with default ids, enqueing them for processing
     ///<C++
     csp_emit(csp_clock_sample, "tick", {});
-    csp_emit(csp_clock_sample, "foo", {});   // an event in an unknown alphabet
+    csp_emit(csp_clock_sample, "foo", {});   // an event in an unknown alphabet, a dead letter
     csp_emit(csp_clock_sample, "tock", {});
     csp_emit(csp_clock_sample, "tick", {});
     csp_emit(csp_clock_sample, "tock", {});
@@ -138,6 +152,20 @@ void test_csp()
     csp_update(csp_clock_sample);
 }
 ///>
+/// The definitions themselves can be replaced while the processes run, with
+/// csp_reload. Processes whose definitions didn't change carry on from the
+/// state they were in, so CLOCK2 could be given a new tock behavior without
+/// CLOCK missing a tick.
+///
+/// Many identical processes, a clock per connection say, are written once
+/// as an indexed family:
+///
+///     CLOCK[i:0..9999] = (tick.i -> tock.i -> CLOCK[i] "tocked")
+///
+/// tick.i is the tick of instance i alone, emitted with i as its id, while
+/// an event without an index is engaged by every instance. The outputs of
+/// an instance receive its index as the id. The family is compiled once,
+/// and each instance costs no more than the state it is in.
 
 #ifdef GUSTEAU_chapter2
 
@@ -151,8 +179,17 @@ void test_csp()
 /// Some of these commands do nothing but respond, output, and wait to respond again
 /// and as such their definition is a bit boring. When we get to more complex
 /// programs, we'll see more interesting state machines than this.
+///
+/// Events can be declared to be of high or low priority; they are otherwise
+/// of normal priority. Pending high priority events are processed first, so
+/// that a quit is never stuck behind a backlog of ticks.
+/// Ticks also coalesce; if several ticks are pending, they are processed
+/// as a single tick that carries how many ticks there were.
 ///<C++
 char* csp_ac_src = R"csp(
+    priority high (quit)
+    priority low (tick)
+    coalesce count (tick)
     APPEND_LINE = (append_line -> APPEND_LINE "append_line")
     POP_LINE = (pop_line -> POP_LINE "pop_line")
     QUIT = (quit -> STOP "join_now")
@@ -235,10 +272,11 @@ public:
         });
         ///>
         /// Whenever a tick occurs; the variable count will be incremented.
+        /// Since ticks coalesce, the id of a tick is the number of ticks.
         ///<C++
-        csp_bind_lambda(csp, "tick", [this](int)
+        csp_bind_lambda(csp, "tick", [this](int ticks)
         {
-            ++count;
+            count += ticks;
             ///>
             /// Ticking is not an action that was initiated by the user and doesn't
             /// need to appear in a journal.
@@ -250,17 +288,11 @@ public:
         csp_bind_lambda(csp, "join_now", [this](int) { join_now = true; });
         ///>
 
-        /// A demonstration thread that runs at 10Hz, emitting ticks as it goes.
-        /// This shows a very simple way that threads can communicate.
+        /// A clock that ticks at 10Hz. Rather than dedicating a thread to
+        /// sleeping between ticks, the tick is scheduled as a periodic event,
+        /// which the csp emits itself as its updates pass each 100ms.
         ///<C++
-        clock = std::thread([this]()
-        {
-            while (!join_now)
-            {
-                csp_emit(csp, "tick", 0);
-                std::this_thread::sleep_for(std::chrono::milliseconds(100));
-            }
-        });
+        csp_schedule(csp, "tick", 0, std::chrono::milliseconds(100), std::chrono::milliseconds(100));
     }
     ///>
     /// Given a journal, replay that journal on the current context.
@@ -354,11 +386,6 @@ public:
         ///<C++
         join_now = true;
 
-        ///>
-        /// Allow the clock thread to join gracefully
-        ///<C++
-        clock.join();
-
         delete csp;
         delete blackboard;
     }
@@ -375,18 +402,20 @@ public:
 /// they will be bottlenecked and serialized through the main UI thread, and
 /// the main UI thread will call any bound lambdas which might optionally
 /// dispatch new work to other threads.
+/// Each update is given a small time budget, so that a burst of events from
+/// a busy producer can't stall the frame; whatever doesn't fit in the budget
+/// is dispatched on the next update.
 ///<C++
     virtual void Update() override
     {
         if (csp)
-            csp_update(csp);
+            csp_update(csp, 0, std::chrono::milliseconds(4));
     }
 ///>
 
     GraphicsContext& root_graphics_context;
     StateContext state;
     RenderContext render;
-    std::thread clock;
 
     int count = 0;
     std::vector<std::string> lines;
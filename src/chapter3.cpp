@@ -24,7 +24,6 @@
 #undef LABTEXT_ODR
 #include "chapter1.cpp"
 #include "csp.h"
-#include "blackboard.h"
 #include "journal.h"
 #include <thread>
 ///
@@ -49,7 +48,6 @@ class ApplicationContext : public ApplicationContextBase
 public: 
     ApplicationContext(GraphicsContext& gc, std::shared_ptr<UIContext> ui_) 
     : root_graphics_context(gc)
-    , blackboard(new Blackboard())
     {
         ui = ui_;
     }
@@ -76,17 +74,16 @@ public:
         /// the application context in all the history's lambdas
         std::shared_ptr<ApplicationContext> app = std::dynamic_pointer_cast<ApplicationContext>(this->shared_from_this());
 
-        csp_bind_lambda(csp, "push_value", [app](int id)
+        ///>
+        /// The push value event carries its floating point value inline in
+        /// the event, so unlike the append line event of Chapter 2 there's no
+        /// round trip through a blackboard. The lambda is bound to receive
+        /// the value directly.
+        ///<C++
+        csp_bind_payload_lambda<float>(csp, "push_value", [app](float value)
         {
-            if (id && app)
+            if (app)
             {
-                ///>
-                /// The append line event comes with a floating point value 
-                ///<C++
-                TypedData* d = blackboard_get(app->blackboard, id);
-                auto td = dynamic_cast<Data<float>*>(d);
-                if (td)
-                {
 ///>
 /// The operation modified the ApplicationContext, so record the operation
 /// in the journal. The journal records both the action that was taken, 
@@ -100,28 +97,19 @@ public:
 /// requires multiple steps that have to go together. We introduce therefore
 /// a Journal::Transaction that records a single atomic history/undo pair.
 ///<C++
-                    Journal::Transaction transaction 
-                    {  "push_value", 
-                        [app, td]() 
-                        {
-                            app->value_stack.push_back(td->value());
-                        },
-                        [app]() 
-                        { 
-                            app->value_stack.pop_back(); 
-                        }
-                    };
-                    transaction.action();
-                    app->journal.commit(std::move(transaction));
-                }
-                else
-                {
-                    ///>
-                    /// The data from the blackboard is not reference counted
-                    /// so it must be deleted here.
-                    ///<C++
-                    delete d;
-                }
+                Journal::Transaction transaction 
+                {  "push_value", 
+                    [app, value]() 
+                    {
+                        app->value_stack.push_back(value);
+                    },
+                    [app]() 
+                    { 
+                        app->value_stack.pop_back(); 
+                    }
+                };
+                transaction.action();
+                app->journal.commit(std::move(transaction));
             }
         });
         csp_bind_lambda(csp, "pop_value", [app](int)
@@ -280,7 +268,6 @@ public:
         join_now = true;
 
         delete csp;
-        delete blackboard;
     }
 
 
@@ -294,12 +281,16 @@ public:
 /// What's going to happen is that events will be emitted from many threads,
 /// they will be bottlenecked and serialized through the main UI thread, and
 /// the main UI thread will call any bound lambdas which might optionally
-/// dispatch new work to other threads.
+/// dispatch new work to other threads. Outputs that are too heavy for the UI
+/// thread can be bound with csp_bind_worker_lambda instead, which runs them
+/// on a pool of workers, in order for each process, and can emit an event
+/// when each call is done.
+/// As in Chapter 2, the update is time budgeted to keep the UI responsive.
 ///<C++
     virtual void Update() override
     {
         if (csp)
-            csp_update(csp);
+            csp_update(csp, 0, std::chrono::milliseconds(4));
     }
 ///>
 
@@ -311,7 +302,6 @@ public:
     std::vector<float> value_stack;
 
     CSP* csp = nullptr;
-    Blackboard* blackboard = nullptr;
 
     Journal journal;
 };
@@ -346,8 +336,7 @@ public:
         if (ImGui::Button("Push"))
         {
             float v = static_cast<float>(atof(buff));
-            int id = blackboard_new_entry(app->blackboard, new Data<float>(v));
-            csp_emit(app->csp, "push_value", id);
+            csp_emit(app->csp, "push_value", 0, csp_payload(v));
         }
         ImGui::SameLine();
         if (ImGui::Button("Pop"))
@@ -1,93 +1,276 @@
-
+#pragma once
 
 #include "LabText.h"
 #include "ConcurrentQueue.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <map>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <mutex>
+#include <set>
+#include <thread>
 #include <vector>
 
-struct CSP_Process
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// One prefix of a definition. In local state from, engaging event leads to
+// local state to, or if to is -1, to the process named behavior, calling the
+// lambda bound to out. A prefix with after_ms set is a timeout of the state
+// rather than an event. Within a family, an indexed event, event.i, is the
+// event of the instance alone, and an indexed behavior, BEHAVIOR[i], is the
+// same instance of another family, or of this one.
+struct CSP_Prefix
 {
-    std::string name;
+    int from = 0;
     std::string event;
+    int after_ms = 0;
     std::string behavior;
+    int to = -1;
     std::string out;
+    bool indexed = false;
+    bool behavior_indexed = false;
+};
+
+// A definition, NAME = (...). Its states are numbered from its initial
+// state, 0, through the anonymous states within chained prefixes and
+// parentheticals. csp_link lays them out from first_state in the csp's
+// transition table. A parallel composition, NAME = P || Q, has no prefixes,
+// and its one state starts its components in its place. Its components must
+// be ordinary processes, as compositions don't nest and a family has no
+// one initial state to start; see csp_check_components. An indexed family,
+// NAME[i:0..N], is a template for its instances 0 through N, whose states
+// are laid out once, however many instances there are.
+struct CSP_Process
+{
+    std::string name;
+    int state_count = 1;
+    std::vector<CSP_Prefix> prefixes;
+    std::vector<std::string> components;
+    int first_state = -1;
+    std::string index;          // the index variable of a family
+    int first_index = 0;
+    int instances = 0;          // zero unless the process is a family
 };
 
+// the target of a transition to STOP. A behavior naming a process that has
+// not been parsed also stops, until a merge defines it.
+constexpr int CSP_STOP = -1;
+
+// the target of a transition table entry for an event the state refuses
+constexpr int CSP_REFUSE = -2;
+
 using lab::Text::StrView;
 
-StrView parse_csp_process(StrView curr, std::vector<std::unique_ptr<CSP_Process>>& processes, bool& error_raised)
+StrView parse_csp_process(StrView curr, CSP_Process* p, int from, bool& error_raised);
+
+// Parse the index that may follow an event, .i, or a behavior, [i], which
+// must name the index variable of p.
+StrView parse_csp_index(StrView curr, CSP_Process* p, bool& event_indexed, bool& behavior_indexed,
+                        bool& error_raised)
 {
-    // starting from just after the opening parenthesis
-    curr = SkipCommentsAndWhitespace(curr);
+    StrView open = Expect(curr, StrView{".", 1});
+    event_indexed = open != curr;
+    if (!event_indexed)
+    {
+        open = Expect(curr, StrView{"[", 1});
+        behavior_indexed = open != curr;
+        if (!behavior_indexed)
+            return curr;
+    }
+
     StrView token;
-    curr = GetTokenAlphaNumeric(curr, token);
-    if (IsEmpty(token))
+    curr = GetTokenAlphaNumeric(open, token);
+    if (!p->instances || token != StrView{p->index.c_str(), p->index.size()})
     {
         error_raised = true;
         return curr;
     }
+    if (behavior_indexed)
+    {
+        token = Expect(curr, StrView{"]", 1});
+        if (token == curr)
+            error_raised = true;
+        curr = token;
+    }
+    return curr;
+}
 
-    CSP_Process* p = (*processes.rbegin()).get();
-    p->event.assign(token.curr, token.sz);
-
+// Parse one branch of a choice of p, in local state from. Chained prefixes,
+// (a -> b -> P), and nested parentheticals, (a -> (b -> P)), step through
+// new anonymous states of p. An output string applies to the prefix leading
+// to the behavior or parenthetical it follows.
+StrView parse_csp_branch(StrView curr, CSP_Process* p, int from, bool& error_raised)
+{
     curr = SkipCommentsAndWhitespace(curr);
-    token = Expect(curr, StrView{"->", 2});
-    if (token == curr)
+    StrView token;
+    curr = GetTokenAlphaNumeric(curr, token);
+    if (IsEmpty(token))
     {
         error_raised = true;
         return curr;
     }
-    curr = SkipCommentsAndWhitespace(token);
 
-    // check for the parenthetical recursive form: event -> (PROCESS)
-    token = Expect(curr, StrView{"(", 1});
-    if (token != curr)
+    CSP_Prefix prefix;
+    prefix.from = from;
+    prefix.event.assign(token.curr, token.sz);
+    bool behavior_indexed = false;
+    curr = parse_csp_index(curr, p, prefix.indexed, behavior_indexed, error_raised);
+    if (error_raised || behavior_indexed)
     {
-        // create an anonymous nested process
-        static int unique = 0;
-        CSP_Process* p2 = new CSP_Process();
-        char buff[256];
-        sprintf(buff, "__%s_%d", p->name.c_str(), unique++);
-        p2->name.assign(buff);
-        p->behavior = p2->name;
-        processes.emplace_back(std::unique_ptr<CSP_Process>(p2));
-
-        curr = parse_csp_process(token, processes, error_raised);
-        if (error_raised)
-            return curr;
+        error_raised = true;
+        return curr;
     }
-    else
+    size_t last = 0;    // the prefix an output string applies to
+    while (true)
     {
-        curr = GetTokenAlphaNumeric(curr, token);
-        if (IsEmpty(token))
+        curr = SkipCommentsAndWhitespace(curr);
+        token = Expect(curr, StrView{"->", 2});
+        if (token == curr)
         {
             error_raised = true;
             return curr;
         }
-        p->behavior.assign(token.curr, token.sz);
+        curr = SkipCommentsAndWhitespace(token);
 
-        // given that event1 -> event2 has been parsed,
-        // test for chained form: event1 -> event2 -> event3
-        curr = SkipCommentsAndWhitespace(curr);
-        token = Expect(curr, StrView{"->", 2});
+        // check for the parenthetical recursive form: event -> (PROCESS)
+        token = Expect(curr, StrView{"(", 1});
         if (token != curr)
         {
-            /// @TODO, handle this form.
+            prefix.to = p->state_count++;
+            last = p->prefixes.size();
+            p->prefixes.push_back(std::move(prefix));
+            curr = parse_csp_process(token, p, p->prefixes[last].to, error_raised);
+            if (error_raised)
+                return curr;
+            break;
+        }
+
+        StrView name;
+        curr = GetTokenAlphaNumeric(curr, name);
+        if (IsEmpty(name))
+        {
+            error_raised = true;
+            return curr;
+        }
+        bool event_indexed = false;
+        behavior_indexed = false;
+        curr = parse_csp_index(curr, p, event_indexed, behavior_indexed, error_raised);
+        if (error_raised)
+            return curr;
+
+        // a name followed by another arrow is the next event of a chain,
+        // event1 -> event2 -> BEHAVIOR, otherwise it is the behavior
+        curr = SkipCommentsAndWhitespace(curr);
+        if (Expect(curr, StrView{"->", 2}) == curr)
+        {
+            if (event_indexed)
+            {
+                error_raised = true;
+                return curr;
+            }
+            prefix.behavior.assign(name.curr, name.sz);
+            prefix.behavior_indexed = behavior_indexed;
+            last = p->prefixes.size();
+            p->prefixes.push_back(std::move(prefix));
+            break;
+        }
+        if (behavior_indexed)
+        {
             error_raised = true;
             return curr;
         }
+        prefix.to = p->state_count++;
+        p->prefixes.push_back(prefix);
+        prefix = CSP_Prefix();
+        prefix.from = p->prefixes.back().to;
+        prefix.event.assign(name.curr, name.sz);
+        prefix.indexed = event_indexed;
     }
     curr = SkipCommentsAndWhitespace(curr);
     token = Expect(curr, StrView{"\"", 1}); // check for an output string
     if (token != curr)
     {
         curr = GetString(curr, false, token);
-        p->out.assign(token.curr, token.sz);
+        p->prefixes[last].out.assign(token.curr, token.sz);
         curr = SkipCommentsAndWhitespace(curr);
     }
+    return curr;
+}
+
+// Parse the body of a parenthetical of p, starting just after the opening
+// parenthesis, in local state from. The body is a choice of one or more
+// branches, (a -> P | b -> Q), each taken on its first event, followed by
+// an optional timeout of the state. Where branches start with the same
+// event, the first is taken.
+StrView parse_csp_process(StrView curr, CSP_Process* p, int from, bool& error_raised)
+{
+    StrView token;
+    while (true)
+    {
+        curr = parse_csp_branch(curr, p, from, error_raised);
+        if (error_raised)
+            return curr;
+        token = Expect(curr, StrView{"|", 1});
+        if (token == curr)
+            break;
+        curr = token;
+    }
+
+    // check for a timeout: after milliseconds -> BEHAVIOR "output". The
+    // instances of a family have no timers of their own, so have no timeouts.
+    token = Expect(curr, StrView{"after", 5});
+    if (token != curr)
+    {
+        if (p->instances)
+        {
+            error_raised = true;
+            return curr;
+        }
+        CSP_Prefix timeout;
+        timeout.from = from;
+        curr = SkipCommentsAndWhitespace(token);
+        int32_t ms = 0;
+        token = GetInt32(curr, ms);
+        if (token == curr || ms <= 0)
+        {
+            error_raised = true;
+            return curr;
+        }
+        curr = SkipCommentsAndWhitespace(token);
+        token = Expect(curr, StrView{"->", 2});
+        if (token == curr)
+        {
+            error_raised = true;
+            return curr;
+        }
+        curr = SkipCommentsAndWhitespace(token);
+        curr = GetTokenAlphaNumeric(curr, token);
+        if (IsEmpty(token))
+        {
+            error_raised = true;
+            return curr;
+        }
+        timeout.after_ms = ms;
+        timeout.behavior.assign(token.curr, token.sz);
+        curr = SkipCommentsAndWhitespace(curr);
+        token = Expect(curr, StrView{"\"", 1});
+        if (token != curr)
+        {
+            curr = GetString(curr, false, token);
+            timeout.out.assign(token.curr, token.sz);
+            curr = SkipCommentsAndWhitespace(curr);
+        }
+        p->prefixes.push_back(std::move(timeout));
+    }
     token = Expect(curr, StrView{")", 1});
     if (token == curr)
     {
@@ -96,132 +279,3449 @@ StrView parse_csp_process(StrView curr, std::vector<std::unique_ptr<CSP_Process>
     return token;
 }
 
-struct CSP_Event
-{
-    std::string name;
-    int id;
-};
-struct CSP
-{
-    std::vector<std::unique_ptr<CSP_Process>> processes;
-    std::vector<int> process_active;
-    std::map<std::string, std::function<void(int)>, std::less<>> lambdas;
-    moodycamel::ConcurrentQueue<CSP_Event> q;
-    std::mutex process_data_mutex;
-};
-
-// merge into an existing csp, or return a new one if supplied with nullptr
-CSP* csp_parse(CSP* csp, char const*const src, size_t len)
+// parse a parallel composition of named processes, P || Q || R
+StrView parse_csp_composition(StrView curr, CSP_Process* p, bool& error_raised)
 {
-    if (!csp)
-        csp = new CSP();
-
-    using namespace lab::Text;
-    StrView curr{src, len};
-    curr = SkipCommentsAndWhitespace(curr);
-    bool error_raised = false;
-    while (!IsEmpty(curr) && !error_raised)
+    while (true)
     {
         StrView token;
         curr = GetTokenAlphaNumeric(curr, token);
-        if (curr == token)
+        if (IsEmpty(token))
         {
             error_raised = true;
-            break;
+            return curr;
         }
-
-        CSP_Process* p = new CSP_Process();
-        p->name.assign(token.curr, token.sz);
-        csp->processes.emplace_back(std::unique_ptr<CSP_Process>(p));
-
+        p->components.emplace_back(token.curr, token.sz);
         curr = SkipCommentsAndWhitespace(curr);
-        token = Expect(curr, StrView{"=", 1});
-        if (token == curr)
-        {
-            error_raised = true;
-            break;
-        }
-        curr = SkipCommentsAndWhitespace(token);
-        token = Expect(curr, StrView{"(", 1});
+        token = Expect(curr, StrView{"||", 2});
         if (token == curr)
-        {
-            error_raised = true;
             break;
-        }
-
         curr = SkipCommentsAndWhitespace(token);
-        curr = parse_csp_process(curr, csp->processes, error_raised);
-        curr = SkipCommentsAndWhitespace(curr);
     }
+    if (p->components.size() < 2)
+        error_raised = true;
+    return curr;
+}
+
+// A small value carried inline by an event. Values that fit are passed
+// directly to lambdas bound with csp_bind_payload_lambda; larger data should
+// go through a blackboard, with the event carrying the blackboard id.
+constexpr size_t CSP_PAYLOAD_SIZE = 24;
+
+using CSP_Float2 = std::array<float, 2>;
+using CSP_Float3 = std::array<float, 3>;
+using CSP_Float4 = std::array<float, 4>;
+
+struct CSP_Payload
+{
+    enum class Type : uint8_t { None, Int, Float, Double, Float2, Float3, Float4, String };
+
+    Type type = Type::None;
+    alignas(8) char data[CSP_PAYLOAD_SIZE] = {};
+};
+
+template <typename T> struct CSP_PayloadType;
+template <> struct CSP_PayloadType<int>        { static constexpr CSP_Payload::Type type = CSP_Payload::Type::Int; };
+template <> struct CSP_PayloadType<float>      { static constexpr CSP_Payload::Type type = CSP_Payload::Type::Float; };
+template <> struct CSP_PayloadType<double>     { static constexpr CSP_Payload::Type type = CSP_Payload::Type::Double; };
+template <> struct CSP_PayloadType<CSP_Float2> { static constexpr CSP_Payload::Type type = CSP_Payload::Type::Float2; };
+template <> struct CSP_PayloadType<CSP_Float3> { static constexpr CSP_Payload::Type type = CSP_Payload::Type::Float3; };
+template <> struct CSP_PayloadType<CSP_Float4> { static constexpr CSP_Payload::Type type = CSP_Payload::Type::Float4; };
+
+template <typename T>
+CSP_Payload csp_payload(const T& value)
+{
+    static_assert(sizeof(T) <= CSP_PAYLOAD_SIZE, "payload type is too large");
+    CSP_Payload p;
+    p.type = CSP_PayloadType<T>::type;
+    memcpy(p.data, &value, sizeof(T));
+    return p;
+}
 
-    size_t sz = csp->processes.size();
-    csp->process_active.resize(sz);
-    for (auto i = 0; i < sz; ++i)
+// strings longer than CSP_PAYLOAD_SIZE - 1 are truncated
+CSP_Payload csp_payload(char const*const str)
+{
+    CSP_Payload p;
+    if (str)
     {
-        if (csp->processes[i]->name[0] == '_')
-            csp->process_active[i] = 0;
-        else
-            csp->process_active[i] = 1;
+        p.type = CSP_Payload::Type::String;
+        strncpy(p.data, str, CSP_PAYLOAD_SIZE - 1);
     }
-    return csp;
+    return p;
 }
 
-void csp_bind_lambda(CSP* csp, char const*const name, std::function<void(int)> fn)
+// returns false if the payload does not hold a T
+template <typename T>
+bool csp_payload_get(const CSP_Payload& p, T& value)
 {
-    if (!csp || !name || !fn)
-        return;
+    if (p.type != CSP_PayloadType<T>::type)
+        return false;
+    memcpy(&value, p.data, sizeof(T));
+    return true;
+}
 
-    // guard against adding processes, or changing them
-    std::unique_lock<std::mutex> lock(csp->process_data_mutex);
-    csp->lambdas[name] = fn;
+// the string points into the payload, and is valid as long as the payload is
+inline bool csp_payload_get(const CSP_Payload& p, char const*& value)
+{
+    if (p.type != CSP_Payload::Type::String)
+        return false;
+    value = p.data;
+    return true;
+}
+
+struct CSP_Event
+{
+    int event;  // interned event id, see csp_find_event
+    int id;
+    CSP_Payload payload;
+};
+
+// A bound output. Lambdas bound by csp_bind_lambda receive the event id,
+// those bound by csp_bind_payload_lambda receive the payload.
+struct CSP_Slot
+{
+    std::function<void(int)> fn;
+    std::function<void(const CSP_Payload&)> payload_fn;
+
+    // set by csp_bind_worker_lambda, with the event to emit once a call
+    // completes, if any
+    bool on_worker = false;
+    std::string done;
+
+    // set by csp_bind_batch_lambda and csp_bind_batch_payload_lambda
+    std::function<void(const int*, size_t)> batch_fn;
+    std::function<void(const CSP_Payload*, size_t)> batch_payload_fn;
+};
+
+// the calls of a batch slot made during a csp_update, delivered at once
+// when it finishes
+struct CSP_Batch
+{
+    std::shared_ptr<const CSP_Slot> slot;
+    std::vector<int> ids;
+    std::vector<CSP_Payload> payloads;
+};
+
+// The bound lambdas of a csp, indexed by slot, null where unbound. A table
+// is immutable once published, and binding publishes a copy, so dispatch
+// calls lambdas without taking a lock. Slots past the end are unbound.
+struct CSP_SlotTable
+{
+    std::vector<std::shared_ptr<const CSP_Slot>> lambdas;
+};
+
+// the number of events csp_update dequeues at a time, and with parallel
+// dispatch, where a batch is split between threads
+constexpr size_t CSP_DRAIN_BATCH = 64;
+constexpr size_t CSP_PARALLEL_BATCH = 1024;
+
+// the transitions from which a state's branches are hashed, see
+// CSP_Tables::state_branches
+constexpr size_t CSP_WIDE_STATE = 16;
+
+// Events are queued in a lane per priority class, and csp_update drains the
+// lanes highest priority first. Events default to normal priority.
+enum CSP_Priority : int
+{
+    CSP_PRIORITY_HIGH = 0,
+    CSP_PRIORITY_NORMAL,
+    CSP_PRIORITY_LOW,
+    CSP_PRIORITY_COUNT
+};
+
+// the names of the priority classes in the DSL, in CSP_Priority order
+char const*const csp_priority_names[CSP_PRIORITY_COUNT] = { "high", "normal", "low" };
+
+// Events that only matter for their latest instance, such as ticks or
+// progress updates, can coalesce. While a coalescing event is pending, further
+// emits are folded into it rather than queued, so it is dispatched once with
+// either the number of instances as its id, or the latest instance's id and
+// payload.
+enum CSP_Coalesce : int
+{
+    CSP_COALESCE_NONE = 0,
+    CSP_COALESCE_COUNT,
+    CSP_COALESCE_LATEST,
+    CSP_COALESCE_MODE_COUNT
+};
+
+// the names of the coalescing modes in the DSL, in CSP_Coalesce order
+char const*const csp_coalesce_names[CSP_COALESCE_MODE_COUNT] = { "none", "count", "latest" };
+
+// The coalescing state of an event. count is nonzero while an instance is
+// pending, whatever the mode is by the time it is dequeued. unreserved
+// counts the instances in the lanes that were enqueued without counting
+// against the capacity, so that as many dequeues give no room back, even
+// if the mode has changed since.
+struct CSP_Coalesced
+{
+    std::atomic<int> mode{CSP_COALESCE_NONE};
+    std::atomic<int> count{0};  // instances folded into the pending event
+    std::atomic<int> unreserved{0};
+    std::mutex latest_mutex;
+    CSP_Event latest{-1, 0, {}};
+};
+
+// A lane with a weight of zero is drained strictly before lower lanes. A
+// lane with a weight of n yields to lower lanes after n events, until every
+// lane with pending events has spent its weight.
+struct CSP_Lane
+{
+    moodycamel::ConcurrentQueue<CSP_Event> q;
+    moodycamel::ConsumerToken consumer{q};
+    size_t weight = 0;
+    size_t credit = 0;
+};
+
+// What an emit does when the lanes are at capacity, see csp_set_capacity
+enum CSP_Backpressure : int
+{
+    CSP_BACKPRESSURE_BLOCK = 0,     // the emitting thread waits for room
+    CSP_BACKPRESSURE_DROP_NEWEST,   // events that don't fit are dropped
+    CSP_BACKPRESSURE_DROP_OLDEST,   // old events are dropped to make room
+    CSP_BACKPRESSURE_FAIL,          // an emit that doesn't fit is refused
+};
+
+struct CSP_Stats
+{
+    uint64_t dropped = 0;   // events discarded to stay within capacity
+    uint64_t blocked = 0;   // emits that waited for room
+    uint64_t refused = 0;   // events refused by CSP_BACKPRESSURE_FAIL
+    uint64_t dead_letters = 0;  // events emitted that nothing subscribes to
+};
+
+// Timers live in a hierarchical timing wheel of CSP_TIMER_LEVELS levels of
+// CSP_TIMER_SLOTS slots each. A slot of level n spans all of level n - 1, so
+// scheduling and cancelling are O(1), and a timer moves down at most once
+// per level before it expires. Time is counted in ticks of
+// CSP_TIMER_RESOLUTION from the creation of the wheel.
+using CSP_Clock = std::chrono::steady_clock;
+constexpr std::chrono::microseconds CSP_TIMER_RESOLUTION{1000};
+constexpr int CSP_TIMER_LEVELS = 4;
+constexpr int CSP_TIMER_SLOT_BITS = 6;
+constexpr int CSP_TIMER_SLOTS = 1 << CSP_TIMER_SLOT_BITS;
+
+struct CSP_Timer
+{
+    uint64_t expiry = 0;        // tick at which the timer expires
+    uint64_t period = 0;        // ticks between repeats, zero for one shot
+    uint64_t handle = 0;
+    CSP_Event event = {};       // emitted on expiry, unless state is set
+    int state = -1;             // the state whose timeout this is
+    uint32_t generation = 1;    // bumped on reuse, so stale handles miss
+    int slot = -1;              // the wheel slot holding the timer, or -1
+    int prev = -1;
+    int next = -1;              // next in the slot, or in the free list
+};
+
+struct CSP_TimerWheel
+{
+    CSP_TimerWheel() { std::fill(std::begin(slots), std::end(slots), -1); }
+
+    std::mutex mutex;
+    CSP_Clock::time_point start = CSP_Clock::now();
+    uint64_t now = 0;           // the tick the wheel has advanced to
+    size_t scheduled = 0;
+    std::vector<CSP_Timer> timers;
+    int free = -1;
+    int slots[CSP_TIMER_LEVELS * CSP_TIMER_SLOTS];
+
+    // timers that expired in the current csp_update, owned by its thread
+    std::vector<CSP_Timer> expired;
+};
+
+uint64_t csp_timer_tick(CSP_TimerWheel& w, CSP_Clock::time_point t)
+{
+    return uint64_t((t - w.start) / CSP_TIMER_RESOLUTION);
 }
 
-void csp_emit(CSP* csp, char const*const name, int id)
+// a duration in ticks, rounded up
+uint64_t csp_timer_ticks(std::chrono::microseconds d)
 {
-    if (csp && name)
-        csp->q.enqueue({std::string{name}, id});
+    if (d.count() <= 0)
+        return 0;
+    return uint64_t((d.count() + CSP_TIMER_RESOLUTION.count() - 1) / CSP_TIMER_RESOLUTION.count());
 }
 
-void csp_update(CSP* csp)
+// put a timer in the slot for its expiry, which is taken to be no earlier
+// than the earliest tick still to be visited
+void csp_timer_link(CSP_TimerWheel& w, int index, uint64_t earliest)
 {
-    if (!csp)
-        return;
+    CSP_Timer& t = w.timers[index];
+    uint64_t expiry = std::max(t.expiry, earliest);
+    uint64_t delta = expiry - w.now;
 
-    // guard against adding processes, or changing them
-    std::unique_lock<std::mutex> lock(csp->process_data_mutex);
-    CSP_Event event;
-    while (csp->q.try_dequeue(event))
+    // a timer beyond the span of the wheel waits in the furthest slot, and
+    // is placed again when that slot cascades
+    uint64_t span = uint64_t(1) << (CSP_TIMER_SLOT_BITS * CSP_TIMER_LEVELS);
+    if (delta >= span)
+        expiry = w.now + span - 1;
+
+    int level = 0;
+    while (level < CSP_TIMER_LEVELS - 1 && delta >> (CSP_TIMER_SLOT_BITS * (level + 1)))
+        ++level;
+
+    int slot = level * CSP_TIMER_SLOTS + int((expiry >> (CSP_TIMER_SLOT_BITS * level)) & (CSP_TIMER_SLOTS - 1));
+    t.slot = slot;
+    t.prev = -1;
+    t.next = w.slots[slot];
+    if (t.next >= 0)
+        w.timers[t.next].prev = index;
+    w.slots[slot] = index;
+}
+
+void csp_timer_unlink(CSP_TimerWheel& w, int index)
+{
+    CSP_Timer& t = w.timers[index];
+    if (t.prev >= 0)
+        w.timers[t.prev].next = t.next;
+    else
+        w.slots[t.slot] = t.next;
+    if (t.next >= 0)
+        w.timers[t.next].prev = t.prev;
+    t.slot = -1;
+}
+
+void csp_timer_free(CSP_TimerWheel& w, int index)
+{
+    CSP_Timer& t = w.timers[index];
+    t.slot = -1;
+    ++t.generation;
+    t.next = w.free;
+    w.free = index;
+    --w.scheduled;
+}
+
+// add a timer to the wheel, returning its handle; w.mutex must be held
+uint64_t csp_timer_add(CSP_TimerWheel& w, const CSP_Timer& timer)
+{
+    int index = w.free;
+    if (index >= 0)
+        w.free = w.timers[index].next;
+    else
+    {
+        index = static_cast<int>(w.timers.size());
+        w.timers.emplace_back();
+    }
+
+    CSP_Timer& t = w.timers[index];
+    uint32_t generation = t.generation;
+    t = timer;
+    t.generation = generation;
+    t.handle = (uint64_t(generation) << 32) | uint32_t(index);
+    csp_timer_link(w, index, w.now + 1);
+    ++w.scheduled;
+    return t.handle;
+}
+
+// returns false if the timer has expired, or was already cancelled;
+// w.mutex must be held
+bool csp_timer_remove(CSP_TimerWheel& w, uint64_t handle)
+{
+    uint32_t index = uint32_t(handle);
+    if (index >= w.timers.size())
+        return false;
+
+    CSP_Timer& t = w.timers[index];
+    if (t.handle != handle || t.slot < 0)
+        return false;
+
+    csp_timer_unlink(w, index);
+    csp_timer_free(w, index);
+    return true;
+}
+
+// point the timeout with the handle at the new index of its state, after
+// the processes are recompiled. w.mutex must be held.
+void csp_timer_retarget(CSP_TimerWheel& w, uint64_t handle, int state)
+{
+    uint32_t index = uint32_t(handle);
+    if (index < w.timers.size() && w.timers[index].handle == handle && w.timers[index].slot >= 0)
+        w.timers[index].state = state;
+}
+
+// advance the wheel to tick, appending the timers that expire on the way to
+// expired. Periodic timers are put back, skipping any periods that were
+// missed entirely; one shot timers are freed. w.mutex must be held.
+void csp_timer_advance(CSP_TimerWheel& w, uint64_t tick, std::vector<CSP_Timer>& expired)
+{
+    while (w.now < tick)
     {
-        size_t sz = csp->processes.size();
-        for (int i = 0; i < sz; ++i)
+        if (!w.scheduled)
         {
-            if (csp->process_active[i] != 1)
-                continue;
+            w.now = tick;
+            break;
+        }
 
-            CSP_Process* p = csp->processes[i].get();
+        ++w.now;
 
-            if (event.name != p->event)
-                continue;
+        // as each level wraps, spread the next slot of the level above it
+        // over the levels below
+        for (int level = 1; level < CSP_TIMER_LEVELS; ++level)
+        {
+            if (w.now & ((uint64_t(1) << (CSP_TIMER_SLOT_BITS * level)) - 1))
+                break;
 
-            auto fn_it = csp->lambdas.find(p->out);
-            if (fn_it != csp->lambdas.end())
+            int slot = level * CSP_TIMER_SLOTS + int((w.now >> (CSP_TIMER_SLOT_BITS * level)) & (CSP_TIMER_SLOTS - 1));
+            int i = w.slots[slot];
+            w.slots[slot] = -1;
+            while (i >= 0)
             {
-                std::function<void(int)>& fn = fn_it->second;
-                fn(event.id);
+                int next = w.timers[i].next;
+                csp_timer_link(w, i, w.now);
+                i = next;
             }
+        }
 
-            // common case: recur.
-            if (p->name == p->behavior)
+        int i = w.slots[w.now & (CSP_TIMER_SLOTS - 1)];
+        w.slots[w.now & (CSP_TIMER_SLOTS - 1)] = -1;
+        while (i >= 0)
+        {
+            CSP_Timer& t = w.timers[i];
+            int next = t.next;
+            if (t.expiry > w.now)
+                csp_timer_link(w, i, w.now);    // parked beyond the span
+            else
+            {
+                expired.push_back(t);
+                if (t.period)
+                {
+                    t.expiry += t.period;
+                    if (t.expiry <= w.now)
+                        t.expiry = w.now + t.period;
+                    csp_timer_link(w, i, w.now + 1);
+                }
+                else
+                    csp_timer_free(w, i);
+            }
+            i = next;
+        }
+    }
+}
+
+// the time of the next tick that may expire a timer, or time_point::max()
+// if no timers are scheduled. Ticks that cascade a level are included, as
+// timers may come due there.
+CSP_Clock::time_point csp_timer_deadline(CSP_TimerWheel& w)
+{
+    std::lock_guard<std::mutex> lock(w.mutex);
+    if (!w.scheduled)
+        return CSP_Clock::time_point::max();
+
+    uint64_t tick = w.now + 1;
+    for (; tick & (CSP_TIMER_SLOTS - 1); ++tick)
+        if (w.slots[tick & (CSP_TIMER_SLOTS - 1)] >= 0)
+            break;
+    return w.start + int64_t(tick) * CSP_TIMER_RESOLUTION;
+}
+
+// An array of the tables of a program, which either owns its elements or
+// views those of an image mapped into memory, see CSP_Tables::image. It is
+// moved into place and never copied.
+template <typename T>
+struct CSP_Array
+{
+    std::vector<T> owned;
+    const T* first = nullptr;
+    size_t count = 0;
+
+    CSP_Array() = default;
+    CSP_Array(std::vector<T>&& elements) : owned(std::move(elements)), first(owned.data()), count(owned.size()) {}
+    CSP_Array(const T* elements, size_t n) : first(elements), count(n) {}
+    CSP_Array(CSP_Array&&) = default;
+    CSP_Array& operator=(CSP_Array&&) = default;
+    CSP_Array(const CSP_Array&) = delete;
+    CSP_Array& operator=(const CSP_Array&) = delete;
+
+    size_t size() const { return count; }
+    bool empty() const { return !count; }
+    const T* data() const { return first; }
+    const T* begin() const { return first; }
+    const T* end() const { return first + count; }
+    const T& operator[](size_t i) const { return first[i]; }
+};
+
+// a row of CSP_Rows
+template <typename T>
+struct CSP_Range
+{
+    const T* first;
+    const T* last;
+
+    size_t size() const { return size_t(last - first); }
+    bool empty() const { return first == last; }
+    const T* begin() const { return first; }
+    const T* end() const { return last; }
+    const T& operator[](size_t i) const { return first[i]; }
+};
+
+// Rows of values laid out one after another, row i from offsets[i] to
+// offsets[i + 1], so that a table of rows is two arrays however many rows
+// it has.
+template <typename T>
+struct CSP_Rows
+{
+    CSP_Array<int> offsets;
+    CSP_Array<T> values;
+
+    size_t size() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+    CSP_Range<T> operator[](size_t i) const
+    {
+        return {values.data() + offsets[i], values.data() + offsets[i + 1]};
+    }
+};
+
+// lay out rows built one vector each, as csp_compile builds them
+template <typename T>
+CSP_Rows<T> csp_rows(const std::vector<std::vector<T>>& rows)
+{
+    std::vector<int> offsets(1, 0);
+    std::vector<T> values;
+    for (auto& row : rows)
+    {
+        values.insert(values.end(), row.begin(), row.end());
+        offsets.push_back(int(values.size()));
+    }
+    return {std::move(offsets), std::move(values)};
+}
+
+// An entry of the transition table: the state a transition leads to, or
+// CSP_STOP or CSP_REFUSE, and the slot of the lambda it calls, or -1.
+struct CSP_Edge
+{
+    int target = CSP_REFUSE;
+    int slot = -1;
+};
+
+// a transition of a state on an event, see CSP_Tables::transitions
+struct CSP_Transition
+{
+    int event;
+    CSP_Edge edge;
+};
+
+struct CSP_Timeout
+{
+    int ms = 0;                 // zero if the state has no timeout
+    CSP_Edge edge;
+};
+
+// Sets of states are packed bitsets of 64 bit words, indexed by the bits
+// a program assigns to its states. A mask holds the words of a set from
+// word first on, so a set confined to a few words stays small.
+struct CSP_Mask
+{
+    size_t first = 0;
+    CSP_Range<uint64_t> words;
+};
+
+inline bool csp_bit(const std::vector<uint64_t>& bits, int b)
+{
+    return (bits[b >> 6] >> (b & 63)) & 1;
+}
+
+inline void csp_set_bit(std::vector<uint64_t>& bits, int b)
+{
+    bits[b >> 6] |= uint64_t(1) << (b & 63);
+}
+
+inline void csp_clear_bit(std::vector<uint64_t>& bits, int b)
+{
+    bits[b >> 6] &= ~(uint64_t(1) << (b & 63));
+}
+
+// call f with the index of each bit set in word, lowest first, where the
+// word holds the bits from base on
+template <typename F>
+void csp_for_each_bit(uint64_t word, int base, F&& f)
+{
+    while (word)
+    {
+        int bit = 0;
+#if defined(__GNUC__)
+        bit = __builtin_ctzll(word);
+#else
+        while (!((word >> bit) & 1))
+            ++bit;
+#endif
+        f(base + bit);
+        word &= word - 1;
+    }
+}
+
+// Call f with each bit set in the mask and in set, but not in exclude, in
+// order. The words are intersected a vector at a time, and vectors with no
+// bits set are skipped without looking at their words. f may clear bits
+// of set and exclude that it has been called with.
+template <typename F>
+void csp_for_each_intersection(const CSP_Mask& mask, const std::vector<uint64_t>& set,
+                               const std::vector<uint64_t>& exclude, F&& f)
+{
+    const uint64_t* m = mask.words.begin();
+    const uint64_t* a = set.data() + mask.first;
+    const uint64_t* x = exclude.data() + mask.first;
+    size_t n = mask.words.size();
+    int base = int(mask.first * 64);
+    size_t w = 0;
+#if defined(__AVX2__)
+    for (; w + 4 <= n; w += 4)
+    {
+        __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i*) (m + w)),
+                                     _mm256_loadu_si256((const __m256i*) (a + w)));
+        v = _mm256_andnot_si256(_mm256_loadu_si256((const __m256i*) (x + w)), v);
+        if (_mm256_testz_si256(v, v))
+            continue;
+        alignas(32) uint64_t hits[4];
+        _mm256_store_si256((__m256i*) hits, v);
+        for (int k = 0; k < 4; ++k)
+            csp_for_each_bit(hits[k], base + int(w + k) * 64, f);
+    }
+#elif defined(__SSE2__)
+    for (; w + 2 <= n; w += 2)
+    {
+        __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*) (m + w)),
+                                  _mm_loadu_si128((const __m128i*) (a + w)));
+        v = _mm_andnot_si128(_mm_loadu_si128((const __m128i*) (x + w)), v);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) == 0xffff)
+            continue;
+        alignas(16) uint64_t hits[2];
+        _mm_store_si128((__m128i*) hits, v);
+        csp_for_each_bit(hits[0], base + int(w) * 64, f);
+        csp_for_each_bit(hits[1], base + int(w + 1) * 64, f);
+    }
+#endif
+    for (; w < n; ++w)
+        csp_for_each_bit(m[w] & a[w] & ~x[w], base + int(w) * 64, f);
+}
+
+// An indexed family, whose process's states are the template of every
+// instance
+struct CSP_Family
+{
+    int process = -1;
+    int first_state = -1;
+    int first_index = 0;
+    int instances = 0;
+};
+
+// a state of a family's template engaging an event, either in every
+// instance in that state, or in the instance indexed by the event's id, as
+// the transition of the state on the event was written
+struct CSP_FamilyEvent
+{
+    int family;
+    int state;
+    bool indexed;
+};
+
+// The tables csp_compile builds from the processes of a csp, and the only
+// ones dispatch consults. They are immutable, and shared by the programs
+// published from the same compilation, so changing only the declarations
+// leaves them as they are.
+struct CSP_Tables
+{
+    // for each event id, the states that engage in it
+    CSP_Rows<int> event_states;
+
+    // Row s of transitions holds the transitions of state s sorted by
+    // event; s refuses the events missing from its row. Only the first
+    // compiled_events of the alphabet were compiled. Events added by
+    // csp_add_events after compilation lie past them, and no state engages
+    // in them. Row s of state_branches is empty unless s has at least
+    // CSP_WIDE_STATE transitions, when it hashes events to the indices of
+    // their transitions in the row, or -1, so that dispatch finds the
+    // branch of a wide state without searching. It is derived, and rebuilt
+    // rather than stored in images.
+    CSP_Rows<CSP_Transition> transitions;
+    CSP_Rows<int> state_branches;
+    size_t compiled_events = 0;
+    CSP_Array<int> state_process;
+    CSP_Array<CSP_Timeout> state_timeouts;
+
+    // a hash of each process's name, which picks the worker its calls are
+    // posted to, so that they go to the same one after a reload renumbers
+    // the processes. An instance of a family adds its index.
+    CSP_Array<size_t> process_keys;
+
+    // The initial states of the components that the state of a parallel
+    // composition starts in its place, empty for every other state, and
+    // the synchronizations of the compositions on their shared events. For
+    // each component that engages in the event, a participant of the
+    // synchronization lists the states from which it can, and the event
+    // happens only if every participant is in one of them. The
+    // synchronizations of event e run from event_syncs[e] to
+    // event_syncs[e + 1], and the participants of sync i from
+    // sync_participants[i] to sync_participants[i + 1].
+    CSP_Rows<int> state_forks;
+    CSP_Array<int> event_syncs;
+    CSP_Array<int> sync_participants;
+    CSP_Rows<int> participant_states;
+
+    // the indexed families, the family of each state, or -1, and for each
+    // event, the template states that engage in it. Dispatch applies an
+    // event to the instances of a family, so the template states are never
+    // active. Images hold no families.
+    std::vector<CSP_Family> families;
+    std::vector<int> state_family;
+    std::vector<std::vector<CSP_FamilyEvent>> event_families;
+
+    // the states partitioned by csp_group into groups that can be dispatched
+    // independently, the group of each state, and the group of each event,
+    // or -1 if no state engages in it
+    CSP_Rows<int> group_states;
+    CSP_Array<int> state_group;
+    CSP_Array<int> event_group;
+    std::vector<std::vector<int>> group_families;
+
+    // The bit of each state in the bitsets of its csp's states, and the
+    // state of each bit, or -1 for the bits that pad each group out to a
+    // word of its own, so that the parallel dispatch of one group never
+    // writes to the words of another. Group g holds the words from
+    // group_words[g] to group_words[g + 1]. Row e of event_masks holds the
+    // words of the states engaging event e from word event_first_word[e]
+    // on, which lie in the words of the event's group. fork_bits marks the
+    // states that start a composition, and timed_bits those with a timeout.
+    CSP_Array<int> state_bit;
+    CSP_Array<int> bit_state;
+    CSP_Array<int> group_words;
+    CSP_Array<int> event_first_word;
+    CSP_Rows<uint64_t> event_masks;
+    CSP_Array<uint64_t> fork_bits;
+    CSP_Array<uint64_t> timed_bits;
+
+    // the image the arrays were loaded from, if any, kept mapped while they
+    // view it
+    std::shared_ptr<const void> image;
+};
+
+// the events of a csp interned to dense ids, shared by the programs
+// published from one another until an event is added
+struct CSP_Alphabet
+{
+    std::vector<std::string> names;
+    std::map<std::string, int, std::less<>> ids;
+};
+
+// The processes of a csp as compiled by csp_compile. A program is immutable
+// once published, so emitters read it without locking; changing the
+// processes or the declarations publishes a new program in its place. Event
+// ids are never reused, and a program compiled from another keeps the ids of
+// its events, so ids held by emitters and events already queued stay valid.
+// The arrays indexed by event id are the program's own, and copied when the
+// declarations change, while the alphabet and tables are shared.
+struct CSP_Program
+{
+    std::shared_ptr<const CSP_Alphabet> alphabet = std::make_shared<CSP_Alphabet>();
+    std::shared_ptr<const CSP_Tables> tables = std::make_shared<CSP_Tables>();
+
+    // the priority of each event id, and its coalescing state, null if the
+    // event is queued per instance. The coalescing state is carried over to
+    // the programs compiled from this one, with any instance pending in it.
+    std::vector<int> event_priority;
+    std::vector<std::shared_ptr<CSP_Coalesced>> event_coalesced;
+
+    // whether anything subscribes to each event, a state engaging in it or
+    // csp_add_events, and the emits of it discarded because nothing did,
+    // carried over like the coalescing state
+    std::vector<uint8_t> event_subscribed;
+    std::vector<std::shared_ptr<std::atomic<uint64_t>>> event_dead_letters;
+};
+
+// The instances of a family: the local state of each, or -1 once it has
+// stopped or while it is entering another, the instances in each local
+// state as a bitset, and the instances entering a state during the current
+// event, which they enter once the event has been dispatched.
+struct CSP_Instances
+{
+    std::vector<int32_t> state;
+    std::vector<std::vector<uint64_t>> state_instances;
+    std::vector<std::pair<int32_t, int32_t>> pending;
+};
+
+// The threads of parallel dispatch. csp_pool_run hands out the jobs of a
+// batch to the pool and to the calling thread, and returns once every job
+// is done.
+struct CSP_DispatchPool
+{
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::function<void(size_t)> job;
+    size_t job_count = 0;
+    std::atomic<size_t> next{0};
+    uint64_t batch = 0;
+    size_t busy = 0;
+    bool run = true;
+};
+
+// Emitters count themselves into a reader slot while they hold the
+// published program, as dispatch does while it calls a lambda from the
+// published slot table. The low half of a slot's state counts its readers,
+// and the high half the times the last of them left. A replaced program or
+// table is retired with the state of every slot, and deleted once each slot
+// that had readers then has emptied since, so the slots need never be
+// empty all at once.
+constexpr int CSP_READER_SLOTS = 16;
+constexpr uint64_t CSP_READER_EMPTIED = uint64_t(1) << 32;
+
+struct alignas(64) CSP_ReaderSlot
+{
+    std::atomic<uint64_t> state{0};
+};
+
+// a replaced program or slot table, see csp_retire
+template <typename T>
+struct CSP_Retired
+{
+    std::unique_ptr<const T> item;
+    uint64_t readers[CSP_READER_SLOTS];
+};
+
+// A coroutine process suspended until an event, see csp_coro.h. resume is
+// called with awaiter and the event on the dispatching thread.
+struct CSP_Awaiter
+{
+    void (*resume)(void* awaiter, const CSP_Event& event);
+    void* awaiter;
+};
+
+// A call of a slot bound to run on the worker pool. The task holds the slot,
+// so the call completes even if the output is rebound in the meantime.
+struct CSP_Task
+{
+    std::shared_ptr<const CSP_Slot> slot;
+    CSP_Event event;
+};
+
+// a worker thread, running its tasks in the order they were posted
+struct CSP_Worker
+{
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<CSP_Task> tasks;
+    bool run = true;
+};
+
+struct CSP;
+void csp_stop_dispatcher(CSP* csp);
+void csp_stop_workers(CSP* csp);
+void csp_set_dispatch_threads(CSP* csp, size_t count);
+void csp_signal(CSP* csp);
+
+struct CSP
+{
+    CSP() : program(new CSP_Program()), slots(new CSP_SlotTable()) {}
+    ~CSP()
+    {
+        csp_stop_dispatcher(this);
+        csp_set_dispatch_threads(this, 0);
+        csp_stop_workers(this);
+        for (auto& i : coroutines)
+            i.second(i.first);
+        delete program.load();
+        delete slots.load();
+    }
+
+    // the published program, and the programs it replaced that emitters
+    // may still be reading
+    std::atomic<const CSP_Program*> program;
+    std::vector<CSP_Retired<CSP_Program>> retired;
+    CSP_ReaderSlot readers[CSP_READER_SLOTS];
+
+    // the definitions the program was compiled from, and the priorities and
+    // coalescing modes declared by name, which apply to every program
+    std::vector<std::unique_ptr<CSP_Process>> processes;
+    std::function<void(CSP*)> load_processes;   // see csp_load_processes
+    std::map<std::string, int, std::less<>> event_priority_decls;
+    std::map<std::string, int, std::less<>> event_coalesce_decls;
+    std::set<std::string, std::less<>> event_subscriptions;    // see csp_add_events
+
+    // held while a new program is built and published, so that the
+    // definitions only change under it
+    std::mutex publish_mutex;
+
+    // A state is inactive, active, or pending activation until the current
+    // event has been dispatched, kept as bitsets in the bit order of the
+    // program. An active state with a timeout has the handle of its armed
+    // timer, or zero.
+    std::vector<uint64_t> state_active;
+    std::vector<uint64_t> state_pending;
+    std::vector<uint64_t> state_refused;    // scratch for csp_dispatch
+    std::vector<uint64_t> state_timers;
+    std::vector<CSP_Instances> instances;   // of each family of the program
+
+    // The published slot table, the tables it replaced, and the slot of
+    // each output name. Slots are allocated as outputs are parsed or bound,
+    // and are empty until bound. slot_mutex serializes binding, and guards
+    // lambda_slots and retired_slots; dispatch never takes it.
+    std::atomic<const CSP_SlotTable*> slots;
+    std::vector<CSP_Retired<CSP_SlotTable>> retired_slots;
+    std::map<std::string, int, std::less<>> lambda_slots;
+    std::mutex slot_mutex;
+
+    // the pending calls of each batch slot, sized to the slot table as each
+    // csp_update starts, and whether any are pending
+    std::vector<CSP_Batch> slot_batches;
+    std::atomic<bool> batches_pending{false};
+
+    CSP_Lane lanes[CSP_PRIORITY_COUNT];
+
+    // the capacity of the lanes, zero if unbounded, and the number of queued
+    // events counted against it. Coalescing events are bounded by the size
+    // of the alphabet already, and are not counted.
+    std::atomic<long long> capacity{0};
+    std::atomic<int> backpressure{CSP_BACKPRESSURE_BLOCK};
+    std::atomic<long long> queued{0};
+    std::atomic<int> room_waiters{0};
+    std::mutex room_mutex;
+    std::condition_variable room_available;
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<uint64_t> blocked{0};
+    std::atomic<uint64_t> refused{0};
+
+    // the emits discarded because nothing subscribes to their event, and
+    // those by names outside the alphabet, which have no counter of their own
+    std::atomic<uint64_t> dead_letters{0};
+    std::map<std::string, uint64_t, std::less<>> unknown_dead_letters;
+    std::mutex dead_letter_mutex;
+
+    // the thread in csp_update, which must never block on its own emits,
+    // nor must the threads of parallel dispatch
+    std::atomic<std::thread::id> dispatch_thread;
+
+    // parallel dispatch, see csp_set_dispatch_threads, and the events of the
+    // batch being dispatched bucketed by group
+    std::unique_ptr<CSP_DispatchPool> dispatch_pool;
+    std::vector<std::vector<CSP_Event*>> group_events;
+    std::vector<int> busy_groups;
+
+    // The lanes have two consumers. csp_update dequeues in bulk from a lane
+    // into drain, and events left there when an update runs out of budget
+    // carry over; only it touches drain. Under CSP_BACKPRESSURE_DROP_OLDEST,
+    // csp_drop_oldest also dequeues, on the emitting thread. Whichever takes
+    // an event out of a lane subtracts it from queued, once, so queued never
+    // counts an event that has left the lanes, though it may run over the
+    // capacity between a reservation and the drops that pay for it. Events
+    // that survive are still dispatched in the order each producer emitted
+    // them.
+    std::vector<CSP_Event> drain;
+    size_t drain_next = 0;
+    std::mutex process_data_mutex;
+
+    // the optional dispatcher thread, see csp_start_dispatcher
+    std::thread dispatcher;
+    std::atomic<bool> dispatcher_run{false};
+    std::atomic<bool> dispatcher_waiting{false};
+    std::mutex dispatcher_mutex;
+    std::condition_variable dispatcher_wake;
+    std::condition_variable dispatcher_idle;
+
+    // the worker pool, started by csp_start_workers or on the first call of
+    // a slot bound to run on it. Each process posts to the same worker, see
+    // CSP_Tables::process_keys. The flag lets posts skip starting the pool
+    // once it runs.
+    std::vector<std::unique_ptr<CSP_Worker>> workers;
+    std::mutex workers_mutex;
+    std::atomic<bool> workers_started{false};
+
+    // coroutine processes, see csp_coro.h: the awaiters of each event id,
+    // and the frame of each coroutine with the function that destroys it
+    std::vector<std::vector<CSP_Awaiter>> event_awaiters;
+    std::vector<CSP_Awaiter> resuming;
+    std::map<void*, void(*)(void*)> coroutines;
+
+    // scheduled events and process timeouts, advanced by csp_update. The
+    // flag tells a waiting dispatcher that its deadline may have moved.
+    CSP_TimerWheel timers;
+    std::atomic<bool> timers_changed{false};
+};
+
+// the csp whose parallel dispatch the calling thread belongs to, if any
+CSP*& csp_dispatch_pool_owner()
+{
+    thread_local CSP* owner = nullptr;
+    return owner;
+}
+
+// the csp whose worker pool the calling thread belongs to, if any
+CSP*& csp_worker_owner()
+{
+    thread_local CSP* owner = nullptr;
+    return owner;
+}
+
+int csp_reader_slot()
+{
+    static std::atomic<int> next{0};
+    thread_local int slot = next.fetch_add(1, std::memory_order_relaxed) % CSP_READER_SLOTS;
+    return slot;
+}
+
+// counts the calling thread into a reader slot of a csp while in scope
+struct CSP_Read
+{
+    explicit CSP_Read(CSP* csp)
+    : state(csp->readers[csp_reader_slot()].state)
+    {
+        state.fetch_add(1);
+    }
+
+    // the last reader to leave counts the slot emptied
+    ~CSP_Read()
+    {
+        uint64_t s = state.load(std::memory_order_relaxed);
+        while (!state.compare_exchange_weak(s, uint32_t(s) == 1 ? s - 1 + CSP_READER_EMPTIED : s - 1,
+                                            std::memory_order_release, std::memory_order_relaxed))
+        {}
+    }
+
+    CSP_Read(const CSP_Read&) = delete;
+    CSP_Read& operator=(const CSP_Read&) = delete;
+
+    std::atomic<uint64_t>& state;
+};
+
+// holds the published program of a csp for the lifetime of the read
+struct CSP_ProgramRead : CSP_Read
+{
+    explicit CSP_ProgramRead(CSP* csp)
+    : CSP_Read(csp), program(csp->program.load())
+    {}
+
+    const CSP_Program* program;
+};
+
+// Retire item, which has just been replaced, noting the state of the reader
+// slots. A reader that could have loaded it was counted in before the
+// replacement, and so before the state is read.
+template <typename T>
+void csp_retire(CSP* csp, std::vector<CSP_Retired<T>>& retired, const T* item)
+{
+    CSP_Retired<T> r;
+    r.item.reset(item);
+    for (int i = 0; i < CSP_READER_SLOTS; ++i)
+        r.readers[i] = csp->readers[i].state.load();
+    retired.push_back(std::move(r));
+}
+
+// delete each retired item that every reader slot has passed, having had no
+// readers when it was retired, or having emptied since
+template <typename T>
+void csp_reclaim_retired(CSP* csp, std::vector<CSP_Retired<T>>& retired)
+{
+    if (retired.empty())
+        return;
+
+    uint64_t now[CSP_READER_SLOTS];
+    for (int i = 0; i < CSP_READER_SLOTS; ++i)
+        now[i] = csp->readers[i].state.load();
+    auto passed = [&now](const CSP_Retired<T>& r)
+    {
+        for (int i = 0; i < CSP_READER_SLOTS; ++i)
+            if (uint32_t(r.readers[i]) && r.readers[i] / CSP_READER_EMPTIED == now[i] / CSP_READER_EMPTIED)
+                return false;
+        return true;
+    };
+    retired.erase(std::remove_if(retired.begin(), retired.end(), passed), retired.end());
+}
+
+// the published program, for the holder of process_data_mutex, under which
+// it is replaced
+const CSP_Program* csp_program(CSP* csp)
+{
+    return csp->program.load(std::memory_order_relaxed);
+}
+
+// delete the retired programs that no emitter can still be reading
+void csp_reclaim(CSP* csp)
+{
+    csp_reclaim_retired(csp, csp->retired);
+}
+
+// delete the retired slot tables that dispatch can no longer be calling
+// from; slot_mutex must be held
+void csp_reclaim_slots(CSP* csp)
+{
+    csp_reclaim_retired(csp, csp->retired_slots);
+}
+
+// publish program in place of the current one, which is retired;
+// process_data_mutex must be held
+void csp_replace_program(CSP* csp, const CSP_Program* program)
+{
+    csp_retire(csp, csp->retired, csp->program.exchange(program));
+    csp_reclaim(csp);
+}
+
+// start, or restart, the timeout of a state that has just become active
+void csp_arm_timeout(CSP* csp, int s)
+{
+    const CSP_Timeout& timeout = csp_program(csp)->tables->state_timeouts[s];
+    if (!timeout.ms)
+        return;
+
+    CSP_Timer timer;
+    timer.state = s;
+    {
+        std::lock_guard<std::mutex> lock(csp->timers.mutex);
+        uint64_t& handle = csp->state_timers[s];
+        if (handle)
+            csp_timer_remove(csp->timers, handle);
+        timer.expiry = csp_timer_tick(csp->timers, CSP_Clock::now())
+                     + csp_timer_ticks(std::chrono::milliseconds(timeout.ms));
+        handle = csp_timer_add(csp->timers, timer);
+    }
+    csp->timers_changed = true;
+    csp_signal(csp);
+}
+
+// cancel the timeout of a state that is being left
+void csp_disarm_timeout(CSP* csp, int s)
+{
+    uint64_t& handle = csp->state_timers[s];
+    if (!handle)
+        return;
+
+    std::lock_guard<std::mutex> lock(csp->timers.mutex);
+    csp_timer_remove(csp->timers, handle);
+    handle = 0;
+}
+
+// index the branches of the wide states, see CSP_Tables::state_branches. A
+// row has a power of two slots, at least twice the transitions, probed
+// linearly from the event's low bits; events interned together tend to
+// fall in a run of consecutive slots.
+void csp_index_branches(CSP_Tables* tables)
+{
+    size_t states = tables->transitions.size();
+    std::vector<int> offsets(1, 0);
+    std::vector<int> slots;
+    for (size_t s = 0; s < states; ++s)
+    {
+        auto row = tables->transitions[s];
+        if (row.size() >= CSP_WIDE_STATE)
+        {
+            size_t size = 1;
+            while (size < 2 * row.size())
+                size <<= 1;
+            size_t first = slots.size();
+            slots.resize(first + size, -1);
+            for (size_t i = 0; i < row.size(); ++i)
+            {
+                size_t slot = size_t(row[i].event) & (size - 1);
+                while (slots[first + slot] >= 0)
+                    slot = (slot + 1) & (size - 1);
+                slots[first + slot] = int(i);
+            }
+        }
+        offsets.push_back(int(slots.size()));
+    }
+    tables->state_branches = {std::move(offsets), std::move(slots)};
+}
+
+// the transition of state s on event, or null if s refuses it
+const CSP_Edge* csp_edge(const CSP_Tables* tables, int s, int event)
+{
+    auto row = tables->transitions[s];
+    auto branches = tables->state_branches[s];
+    if (!branches.empty())
+    {
+        size_t mask = branches.size() - 1;
+        for (size_t slot = size_t(event) & mask;; slot = (slot + 1) & mask)
+        {
+            int i = branches[slot];
+            if (i < 0)
+                return nullptr;
+            if (row[i].event == event)
+                return &row[i].edge;
+        }
+    }
+
+    const CSP_Transition* first = std::lower_bound(row.begin(), row.end(), event,
+                                                   [](const CSP_Transition& t, int e) { return t.event < e; });
+    return first != row.end() && first->event == event ? &first->edge : nullptr;
+}
+
+bool csp_state_active(CSP* csp, const CSP_Tables* tables, int s)
+{
+    return csp_bit(csp->state_active, tables->state_bit[s]);
+}
+
+// leave state s for target, which becomes pending
+void csp_transition(CSP* csp, const CSP_Tables* tables, int s, int target)
+{
+    csp_disarm_timeout(csp, s);
+    csp_clear_bit(csp->state_active, tables->state_bit[s]);
+    if (target != CSP_STOP)
+        csp_set_bit(csp->state_pending, tables->state_bit[target]);
+}
+
+// Pending becomes active, to prevent (tick -> tick -> TOCK) from firing
+// immediately the second time, a word of states at a time. A composition
+// becomes its components, and only the states with a timeout are visited
+// to arm it.
+void csp_promote_words(CSP* csp, const CSP_Tables* tables, size_t first, size_t end)
+{
+    uint64_t* active = csp->state_active.data();
+    uint64_t* pending = csp->state_pending.data();
+    for (size_t w = first; w < end; ++w)
+    {
+        uint64_t promoted = pending[w];
+        if (!promoted)
+            continue;
+        pending[w] = 0;
+
+        uint64_t plain = promoted & ~tables->fork_bits[w];
+        active[w] |= plain;
+        csp_for_each_bit(plain & tables->timed_bits[w], int(w * 64), [&](int b)
+        {
+            csp_arm_timeout(csp, tables->bit_state[b]);
+        });
+        csp_for_each_bit(promoted & tables->fork_bits[w], int(w * 64), [&](int b)
+        {
+            for (int component : tables->state_forks[tables->bit_state[b]])
+            {
+                csp_set_bit(csp->state_active, tables->state_bit[component]);
+                csp_arm_timeout(csp, component);
+            }
+        });
+    }
+}
+
+// instance i of a family enters local state, or stops if local is -1
+void csp_enter_instance(CSP_Instances& instances, int i, int local)
+{
+    if (instances.state[i] >= 0)
+        csp_clear_bit(instances.state_instances[instances.state[i]], i);
+    instances.state[i] = local;
+    if (local >= 0)
+        csp_set_bit(instances.state_instances[local], i);
+}
+
+void csp_promote_instances(CSP_Instances& instances)
+{
+    for (auto& entered : instances.pending)
+        csp_enter_instance(instances, entered.first, entered.second);
+    instances.pending.clear();
+}
+
+void csp_promote(CSP* csp)
+{
+    csp_promote_words(csp, csp_program(csp)->tables.get(), 0, csp->state_pending.size());
+    for (auto& instances : csp->instances)
+        csp_promote_instances(instances);
+}
+
+// promote the states of a group, which are the only ones an event or
+// timeout of the group can leave pending
+void csp_promote(CSP* csp, int group)
+{
+    const CSP_Tables* tables = csp_program(csp)->tables.get();
+    csp_promote_words(csp, tables, tables->group_words[group], tables->group_words[group + 1]);
+    for (int family : tables->group_families[group])
+        csp_promote_instances(csp->instances[family]);
+}
+
+int csp_intern_event(CSP_Alphabet* alphabet, const std::string& name)
+{
+    auto it = alphabet->ids.find(name);
+    if (it != alphabet->ids.end())
+        return it->second;
+
+    int event = static_cast<int>(alphabet->names.size());
+    alphabet->names.push_back(name);
+    alphabet->ids[name] = event;
+    return event;
+}
+
+// slot_mutex must be held
+int csp_intern_slot(CSP* csp, const std::string& name)
+{
+    auto it = csp->lambda_slots.find(name);
+    if (it != csp->lambda_slots.end())
+        return it->second;
+
+    int slot = static_cast<int>(csp->lambda_slots.size());
+    csp->lambda_slots[name] = slot;
+    return slot;
+}
+
+// the states reachable from state s through transitions, timeouts, and
+// compositions, s included
+std::vector<int> csp_reachable(const CSP_Tables* tables, int s)
+{
+    std::vector<uint8_t> seen(tables->state_process.size());
+    std::vector<int> states{s};
+    seen[s] = 1;
+    auto visit = [&](int target)
+    {
+        if (target >= 0 && !seen[target])
+        {
+            seen[target] = 1;
+            states.push_back(target);
+        }
+    };
+    for (size_t i = 0; i < states.size(); ++i)
+    {
+        int from = states[i];
+        for (auto& t : tables->transitions[from])
+            visit(t.edge.target);
+        visit(tables->state_timeouts[from].edge.target);
+        for (int component : tables->state_forks[from])
+            visit(component);
+    }
+    return states;
+}
+
+// Partition the states of a program into groups that can be dispatched
+// independently of each other. A state is grouped with the other states of
+// its process, the states it leads to or starts, the states engaging in the
+// same events, and the states calling the same outputs, as their lambdas
+// may share data.
+void csp_group(CSP_Tables* tables)
+{
+    size_t states = tables->state_process.size();
+    size_t events = tables->compiled_events;
+    std::vector<int> parent(states);
+    for (int s = 0; s < int(states); ++s)
+        parent[s] = s;
+    auto find = [&parent](int s)
+    {
+        while (parent[s] != s)
+            s = parent[s] = parent[parent[s]];
+        return s;
+    };
+    auto unite = [&](int a, int b)
+    {
+        if (a < 0 || b < 0)
+            return;
+        a = find(a);
+        b = find(b);
+        if (a != b)
+            parent[std::max(a, b)] = std::min(a, b);
+    };
+
+    // the first state seen for each process and output
+    std::vector<int> process_state;
+    std::vector<int> slot_state;
+    auto share = [&](std::vector<int>& first, int key, int s)
+    {
+        if (key < 0)
+            return;
+        if (size_t(key) >= first.size())
+            first.resize(key + 1, -1);
+        if (first[key] < 0)
+            first[key] = s;
+        else
+            unite(first[key], s);
+    };
+    for (int s = 0; s < int(states); ++s)
+    {
+        share(process_state, tables->state_process[s], s);
+        for (auto& t : tables->transitions[s])
+        {
+            unite(s, t.edge.target);
+            share(slot_state, t.edge.slot, s);
+        }
+        unite(s, tables->state_timeouts[s].edge.target);
+        share(slot_state, tables->state_timeouts[s].edge.slot, s);
+        for (int component : tables->state_forks[s])
+            unite(s, component);
+    }
+    for (size_t event = 0; event < events; ++event)
+    {
+        auto engaged = tables->event_states[event];
+        for (int s : engaged)
+            unite(engaged[0], s);
+    }
+
+    // roots are the lowest state of their group, so groups are numbered in
+    // order of their first state
+    std::vector<std::vector<int>> group_states;
+    std::vector<int> state_group(states, -1);
+    for (int s = 0; s < int(states); ++s)
+    {
+        int root = find(s);
+        if (root == s)
+        {
+            state_group[s] = int(group_states.size());
+            group_states.emplace_back();
+        }
+        state_group[s] = state_group[root];
+        group_states[state_group[s]].push_back(s);
+    }
+    std::vector<int> event_group(events, -1);
+    for (size_t event = 0; event < events; ++event)
+        if (!tables->event_states[event].empty())
+            event_group[event] = state_group[tables->event_states[event][0]];
+    tables->group_families.assign(group_states.size(), {});
+    for (int f = 0; f < int(tables->families.size()); ++f)
+        tables->group_families[state_group[tables->families[f].first_state]].push_back(f);
+
+    // lay the groups out in the bitsets in order, each from a word of its own
+    std::vector<int> state_bit(states, -1);
+    std::vector<int> bit_state;
+    std::vector<int> group_words(1, 0);
+    for (auto& group : group_states)
+    {
+        for (int s : group)
+        {
+            state_bit[s] = int(bit_state.size());
+            bit_state.push_back(s);
+        }
+        bit_state.resize((bit_state.size() + 63) / 64 * 64, -1);
+        group_words.push_back(int(bit_state.size() / 64));
+    }
+    size_t words = bit_state.size() / 64;
+    std::vector<uint64_t> fork_bits(words);
+    std::vector<uint64_t> timed_bits(words);
+    for (int s = 0; s < int(states); ++s)
+    {
+        if (!tables->state_forks[s].empty())
+            csp_set_bit(fork_bits, state_bit[s]);
+        if (tables->state_timeouts[s].ms)
+            csp_set_bit(timed_bits, state_bit[s]);
+    }
+
+    std::vector<int> event_first_word(events, 0);
+    std::vector<int> mask_offsets(1, 0);
+    std::vector<uint64_t> mask_words;
+    for (size_t event = 0; event < events; ++event)
+    {
+        auto engaged = tables->event_states[event];
+        if (!engaged.empty())
+        {
+            int low = state_bit[engaged[0]];
+            int high = low;
+            for (int s : engaged)
+            {
+                low = std::min(low, state_bit[s]);
+                high = std::max(high, state_bit[s]);
+            }
+            event_first_word[event] = low / 64;
+            size_t base = mask_words.size();
+            mask_words.resize(base + high / 64 + 1 - low / 64);
+            for (int s : engaged)
+            {
+                int b = state_bit[s] - low / 64 * 64;
+                mask_words[base + (b >> 6)] |= uint64_t(1) << (b & 63);
+            }
+        }
+        mask_offsets.push_back(int(mask_words.size()));
+    }
+
+    tables->group_states = csp_rows(group_states);
+    tables->state_group = std::move(state_group);
+    tables->event_group = std::move(event_group);
+    tables->state_bit = std::move(state_bit);
+    tables->bit_state = std::move(bit_state);
+    tables->group_words = std::move(group_words);
+    tables->fork_bits = std::move(fork_bits);
+    tables->timed_bits = std::move(timed_bits);
+    tables->event_first_word = std::move(event_first_word);
+    tables->event_masks = {std::move(mask_offsets), std::move(mask_words)};
+}
+
+// true if every component of every composition names an ordinary process,
+// neither a composition nor a family, resolving names as csp_compile does.
+// Unlike a behavior, which stops until a merge defines it, a component must
+// be defined by the processes being built, as it is only started when its
+// composition is entered.
+bool csp_check_components(const std::vector<std::unique_ptr<CSP_Process>>& processes)
+{
+    std::map<std::string_view, const CSP_Process*> defined;
+    for (auto& p : processes)
+        defined.insert({p->name, p.get()});
+    for (auto& p : processes)
+        for (auto& name : p->components)
+        {
+            auto it = defined.find(name);
+            if (it == defined.end() || !it->second->components.empty() || it->second->instances)
+                return false;
+        }
+    return true;
+}
+
+// Compile the processes into a program. Event names are interned to ids,
+// starting from the alphabet of previous, and outputs are looked up in
+// slots, which must hold every output the processes name. Each process's
+// states are laid out after those of the processes before it. A behavior
+// resolves to the initial state of the first process of that name. Where a
+// state has more than one transition for an event, the first one parsed is
+// kept. The declarations are applied when the program is published.
+CSP_Program* csp_compile(std::vector<std::unique_ptr<CSP_Process>>& processes, const CSP_Program* previous,
+                         const std::map<std::string, int, std::less<>>& slots)
+{
+    CSP_Program* program = new CSP_Program();
+    auto alphabet = std::make_shared<CSP_Alphabet>(*previous->alphabet);
+    auto tables = std::make_shared<CSP_Tables>();
+    program->event_coalesced = previous->event_coalesced;
+    program->event_dead_letters = previous->event_dead_letters;
+
+    int state_count = 0;
+    std::map<std::string, int, std::less<>> process_index;
+    for (int i = 0; i < int(processes.size()); ++i)
+    {
+        CSP_Process* p = processes[i].get();
+        p->first_state = state_count;
+        state_count += p->state_count;
+        process_index.insert({p->name, i}); // the first definition wins
+        for (auto& prefix : p->prefixes)
+            if (!prefix.after_ms)
+                csp_intern_event(alphabet.get(), prefix.event);
+    }
+
+    size_t events = alphabet->names.size();
+    tables->compiled_events = events;
+    std::vector<int> state_process(state_count);
+    std::vector<CSP_Timeout> state_timeouts(state_count);
+    std::vector<size_t> process_keys;
+    program->event_coalesced.resize(events);
+    tables->state_family.assign(state_count, -1);
+    tables->event_families.resize(events);
+
+    // the transitions of every state in the order parsed, sorted into rows
+    // once all are known
+    struct Parsed
+    {
+        int from;
+        bool indexed;
+        CSP_Transition transition;
+    };
+    std::vector<Parsed> parsed;
+
+    for (int i = 0; i < int(processes.size()); ++i)
+    {
+        CSP_Process* p = processes[i].get();
+        for (int s = 0; s < p->state_count; ++s)
+            state_process[p->first_state + s] = i;
+        process_keys.push_back(std::hash<std::string_view>()(p->name));
+        int family = -1;
+        if (p->instances)
+        {
+            family = int(tables->families.size());
+            tables->families.push_back(CSP_Family{i, p->first_state, p->first_index, p->instances});
+            for (int s = 0; s < p->state_count; ++s)
+                tables->state_family[p->first_state + s] = family;
+        }
+
+        for (auto& prefix : p->prefixes)
+        {
+            // a family is entered only by the same instance of it, from
+            // another instance
+            CSP_Edge edge;
+            if (prefix.to >= 0)
+                edge.target = p->first_state + prefix.to;
+            else
+            {
+                auto it = process_index.find(prefix.behavior);
+                if (prefix.behavior == "STOP" || it == process_index.end() ||
+                    (processes[it->second]->instances != 0) != prefix.behavior_indexed)
+                    edge.target = CSP_STOP;
+                else
+                    edge.target = processes[it->second]->first_state;
+            }
+            if (!prefix.out.empty())
+                edge.slot = slots.find(prefix.out)->second;
+
+            int from = p->first_state + prefix.from;
+            if (prefix.after_ms)
+            {
+                CSP_Timeout& timeout = state_timeouts[from];
+                if (!timeout.ms)
+                {
+                    timeout.ms = prefix.after_ms;
+                    timeout.edge = edge;
+                }
+                continue;
+            }
+
+            int event = alphabet->ids.find(prefix.event)->second;
+            parsed.push_back(Parsed{from, prefix.indexed, CSP_Transition{event, edge}});
+        }
+    }
+
+    std::stable_sort(parsed.begin(), parsed.end(), [](const Parsed& a, const Parsed& b)
+    {
+        return a.from < b.from || (a.from == b.from && a.transition.event < b.transition.event);
+    });
+    std::vector<int> state_rows(state_count + 1, 0);
+    std::vector<CSP_Transition> transitions;
+    std::vector<std::vector<int>> event_states(events);
+    transitions.reserve(parsed.size());
+    for (size_t i = 0; i < parsed.size(); ++i)
+    {
+        const Parsed& t = parsed[i];
+        int event = t.transition.event;
+        if (i && parsed[i - 1].from == t.from && parsed[i - 1].transition.event == event)
+            continue;
+        transitions.push_back(t.transition);
+        ++state_rows[t.from + 1];
+        event_states[event].push_back(t.from);
+
+        int family = tables->state_family[t.from];
+        if (family >= 0)
+            tables->event_families[event].push_back(CSP_FamilyEvent{family, t.from, t.indexed});
+    }
+    for (int s = 0; s < state_count; ++s)
+        state_rows[s + 1] += state_rows[s];
+    tables->state_process = std::move(state_process);
+    tables->state_timeouts = std::move(state_timeouts);
+    tables->process_keys = std::move(process_keys);
+    tables->transitions = {std::move(state_rows), std::move(transitions)};
+    csp_index_branches(tables.get());
+    tables->event_states = csp_rows(event_states);
+
+    // compositions start their components, which csp_check_components has
+    // found to be ordinary processes, and synchronize them on the events
+    // that more than one of them can engage in
+    std::vector<std::vector<int>> state_forks(state_count);
+    for (auto& p : processes)
+        for (auto& name : p->components)
+            state_forks[p->first_state].push_back(processes[process_index.find(name)->second]->first_state);
+    tables->state_forks = csp_rows(state_forks);
+
+    // for each event, its synchronizations, each the states of each of its
+    // participants ready for it
+    using Sync = std::vector<std::vector<int>>;
+    std::vector<std::vector<Sync>> event_syncs(events);
+    for (auto& p : processes)
+    {
+        std::map<int, Sync> syncs;
+        for (int component : tables->state_forks[p->first_state])
+        {
+            std::map<int, std::vector<int>> ready;
+            for (int s : csp_reachable(tables.get(), component))
+                for (auto& t : tables->transitions[s])
+                    ready[t.event].push_back(s);
+            for (auto& i : ready)
+                syncs[i.first].push_back(std::move(i.second));
+        }
+        for (auto& i : syncs)
+            if (i.second.size() > 1)
+                event_syncs[i.first].push_back(std::move(i.second));
+    }
+    std::vector<int> event_sync_offsets(1, 0);
+    std::vector<int> sync_participants(1, 0);
+    std::vector<std::vector<int>> participant_states;
+    for (auto& syncs : event_syncs)
+    {
+        for (auto& sync : syncs)
+        {
+            for (auto& participant : sync)
+                participant_states.push_back(std::move(participant));
+            sync_participants.push_back(int(participant_states.size()));
+        }
+        event_sync_offsets.push_back(int(sync_participants.size() - 1));
+    }
+    tables->event_syncs = std::move(event_sync_offsets);
+    tables->sync_participants = std::move(sync_participants);
+    tables->participant_states = csp_rows(participant_states);
+    csp_group(tables.get());
+    program->alphabet = std::move(alphabet);
+    program->tables = std::move(tables);
+    return program;
+}
+
+// apply the declared priorities and coalescing modes to the interned events
+void csp_apply_decls(CSP* csp, CSP_Program* program)
+{
+    program->event_priority.assign(program->alphabet->names.size(), CSP_PRIORITY_NORMAL);
+    for (auto& i : csp->event_priority_decls)
+    {
+        auto it = program->alphabet->ids.find(i.first);
+        if (it != program->alphabet->ids.end())
+            program->event_priority[it->second] = i.second;
+    }
+
+    for (auto& i : csp->event_coalesce_decls)
+    {
+        auto it = program->alphabet->ids.find(i.first);
+        if (it == program->alphabet->ids.end())
+            continue;
+        auto& c = program->event_coalesced[it->second];
+        if (!c)
+            c.reset(new CSP_Coalesced());
+        if (c->mode == i.second)
+            continue;
+
+        // a pending instance is collected under the new mode, and the latest
+        // instance is only known if it was folded under it
+        std::lock_guard<std::mutex> lock(c->latest_mutex);
+        c->latest = CSP_Event{-1, 0, {}};
+        c->mode = i.second;
+    }
+
+    size_t event_count = program->alphabet->names.size();
+    program->event_subscribed.assign(event_count, 0);
+    for (size_t e = 0; e < program->tables->event_group.size(); ++e)
+        program->event_subscribed[e] = program->tables->event_group[e] >= 0;
+    for (auto& name : csp->event_subscriptions)
+    {
+        auto it = program->alphabet->ids.find(name);
+        if (it != program->alphabet->ids.end())
+            program->event_subscribed[it->second] = 1;
+    }
+
+    program->event_dead_letters.resize(event_count);
+    for (auto& d : program->event_dead_letters)
+        if (!d)
+            d = std::make_shared<std::atomic<uint64_t>>(0);
+}
+
+// a csp loaded from a precompiled image has its program but not the
+// processes it was compiled from, until they are needed to recompile
+void csp_load_processes(CSP* csp)
+{
+    if (!csp->load_processes)
+        return;
+
+    auto load = std::move(csp->load_processes);
+    csp->load_processes = nullptr;
+    load(csp);
+}
+
+bool csp_same_process(const CSP_Process& a, const CSP_Process& b)
+{
+    if (a.name != b.name || a.state_count != b.state_count ||
+        a.components != b.components || a.prefixes.size() != b.prefixes.size() ||
+        a.first_index != b.first_index || a.instances != b.instances)
+        return false;
+
+    for (size_t i = 0; i < a.prefixes.size(); ++i)
+    {
+        const CSP_Prefix& x = a.prefixes[i];
+        const CSP_Prefix& y = b.prefixes[i];
+        if (x.from != y.from || x.event != y.event || x.after_ms != y.after_ms ||
+            x.behavior != y.behavior || x.to != y.to || x.out != y.out ||
+            x.indexed != y.indexed || x.behavior_indexed != y.behavior_indexed)
+            return false;
+    }
+    return true;
+}
+
+// Match the compiled processes of next with the current ones of the same
+// name, in order of definition. Returns, for each of the state_count states
+// of current, the same state of its match if their definitions are the
+// same, or -1.
+std::vector<int> csp_diff(const std::vector<std::unique_ptr<CSP_Process>>& current,
+                          const std::vector<std::unique_ptr<CSP_Process>>& next, size_t state_count)
+{
+    std::map<std::string, std::vector<const CSP_Process*>, std::less<>> by_name;
+    for (auto& p : current)
+        by_name[p->name].push_back(p.get());
+
+    std::map<std::string, size_t, std::less<>> matched;
+    std::vector<int> remap(state_count, -1);
+    for (auto& p : next)
+    {
+        auto it = by_name.find(p->name);
+        size_t k = matched[p->name]++;
+        if (it == by_name.end() || k >= it->second.size() || !csp_same_process(*it->second[k], *p))
+            continue;
+        for (int s = 0; s < p->state_count; ++s)
+            remap[it->second[k]->first_state + s] = p->first_state + s;
+    }
+    return remap;
+}
+
+// Publish program, compiled from processes, in place of the current one.
+// The states that remap carries over keep their activity and their armed
+// timeouts; processes with none of their states carried over start in their
+// initial state, unless named with a leading underscore.
+// process_data_mutex must be held.
+void csp_publish(CSP* csp, CSP_Program* program, std::vector<std::unique_ptr<CSP_Process>> processes,
+                 const std::vector<int>& remap)
+{
+    csp_apply_decls(csp, program);
+
+    const CSP_Program* previous = csp_program(csp);
+    size_t state_count = program->tables->state_process.size();
+    size_t words = program->tables->bit_state.size() / 64;
+    std::vector<uint64_t> active(words, 0);
+    std::vector<uint64_t> pending(words, 0);
+    std::vector<uint64_t> timers(state_count, 0);
+    std::vector<uint8_t> carried(processes.size(), 0);
+    {
+        std::lock_guard<std::mutex> lock(csp->timers.mutex);
+        for (size_t s = 0; s < csp->state_timers.size(); ++s)
+        {
+            int target = remap[s];
+            uint64_t handle = csp->state_timers[s];
+            if (target < 0)
+            {
+                if (handle)
+                    csp_timer_remove(csp->timers, handle);
+                continue;
+            }
+            int bit = previous->tables->state_bit[s];
+            if (csp_bit(csp->state_active, bit))
+                csp_set_bit(active, program->tables->state_bit[target]);
+            if (csp_bit(csp->state_pending, bit))
+                csp_set_bit(pending, program->tables->state_bit[target]);
+            timers[target] = handle;
+            if (handle)
+                csp_timer_retarget(csp->timers, handle, target);
+            carried[program->tables->state_process[target]] = 1;
+        }
+    }
+    for (size_t i = 0; i < processes.size(); ++i)
+        if (!carried[i] && processes[i]->name[0] != '_' && !processes[i]->instances)
+            csp_set_bit(pending, program->tables->state_bit[processes[i]->first_state]);
+
+    // families carried over keep their instances, and the instances of the
+    // others start in their initial state, as processes do
+    std::vector<CSP_Instances> instances(program->tables->families.size());
+    for (size_t f = 0; f < previous->tables->families.size(); ++f)
+    {
+        int target = remap[previous->tables->families[f].first_state];
+        if (target >= 0)
+            instances[program->tables->state_family[target]] = std::move(csp->instances[f]);
+    }
+    for (size_t f = 0; f < instances.size(); ++f)
+    {
+        const CSP_Family& family = program->tables->families[f];
+        if (!instances[f].state.empty())
+            continue;
+        const CSP_Process& p = *processes[family.process];
+        instances[f].state.assign(family.instances, -1);
+        instances[f].state_instances.assign(p.state_count, std::vector<uint64_t>((family.instances + 63) / 64, 0));
+        if (p.name[0] != '_')
+            for (int i = 0; i < family.instances; ++i)
+                csp_enter_instance(instances[f], i, 0);
+    }
+    csp->instances = std::move(instances);
+
+    csp->state_active = std::move(active);
+    csp->state_pending = std::move(pending);
+    csp->state_timers = std::move(timers);
+    csp->state_refused.assign(words, 0);
+    csp->processes = std::move(processes);
+    csp_replace_program(csp, program);
+    csp_promote(csp);
+}
+
+// Compile processes, with their declarations, and publish them in place of
+// the current processes, or after them if merging. Compilation runs without
+// process_data_mutex, so dispatch carries on until the program is swapped in
+// between two events. Returns false, leaving the csp as it was, if a
+// composition names a component that isn't an ordinary process.
+bool csp_build(CSP* csp, std::vector<std::unique_ptr<CSP_Process>> processes,
+               const std::map<std::string, int, std::less<>>& priority_decls,
+               const std::map<std::string, int, std::less<>>& coalesce_decls, bool merge)
+{
+    std::lock_guard<std::mutex> publishing(csp->publish_mutex);
+    std::unique_lock<std::mutex> lock(csp->process_data_mutex);
+    csp_load_processes(csp);
+    if (merge)
+    {
+        std::vector<std::unique_ptr<CSP_Process>> merged;
+        for (auto& p : csp->processes)
+            merged.emplace_back(new CSP_Process(*p));
+        for (auto& p : processes)
+            merged.emplace_back(std::move(p));
+        processes = std::move(merged);
+    }
+    if (!csp_check_components(processes))
+        return false;
+
+    for (auto& i : priority_decls)
+        csp->event_priority_decls[i.first] = i.second;
+    for (auto& i : coalesce_decls)
+        csp->event_coalesce_decls[i.first] = i.second;
+    std::map<std::string, int, std::less<>> slots;
+    {
+        std::lock_guard<std::mutex> binding(csp->slot_mutex);
+        for (auto& p : processes)
+            for (auto& prefix : p->prefixes)
+                if (!prefix.out.empty())
+                    csp_intern_slot(csp, prefix.out);
+        slots = csp->lambda_slots;
+    }
+    const CSP_Program* current = csp_program(csp);
+    lock.unlock();
+
+    // the current program and processes only change under publish_mutex
+    CSP_Program* program = csp_compile(processes, current, slots);
+    std::vector<int> remap = csp_diff(csp->processes, processes, current->tables->state_process.size());
+
+    lock.lock();
+    csp_publish(csp, program, std::move(processes), remap);
+    return true;
+}
+
+int csp_find_name(StrView name, char const*const* names, int count)
+{
+    for (int i = 0; i < count; ++i)
+        if (name == StrView{names[i], strlen(names[i])})
+            return i;
+    return -1;
+}
+
+// parse the event list of a declaration such as priority high (quit undo),
+// recording value for each event in decls
+StrView parse_csp_event_list(StrView curr, std::map<std::string, int, std::less<>>& decls, int value, bool& error_raised)
+{
+    using namespace lab::Text;
+    StrView token = Expect(curr, StrView{"(", 1});
+    if (token == curr)
+    {
+        error_raised = true;
+        return curr;
+    }
+    curr = SkipCommentsAndWhitespace(token);
+    while (true)
+    {
+        token = Expect(curr, StrView{")", 1});
+        if (token != curr)
+            return token;
+
+        curr = GetTokenAlphaNumeric(curr, token);
+        if (IsEmpty(token))
+        {
+            error_raised = true;
+            return curr;
+        }
+        decls[std::string{token.curr, token.sz}] = value;
+        curr = SkipCommentsAndWhitespace(curr);
+        token = Expect(curr, StrView{",", 1});
+        curr = SkipCommentsAndWhitespace(token);
+    }
+}
+
+// parse the range of an indexed family, i:first..last], starting just after
+// the opening bracket
+StrView parse_csp_family(StrView curr, CSP_Process* p, bool& error_raised)
+{
+    auto expect = [&curr](char const*const str, size_t sz)
+    {
+        curr = SkipCommentsAndWhitespace(curr);
+        StrView next = Expect(curr, StrView{str, sz});
+        bool found = next != curr;
+        curr = next;
+        return found;
+    };
+    auto number = [&curr](int32_t& value)
+    {
+        curr = SkipCommentsAndWhitespace(curr);
+        StrView next = GetInt32(curr, value);
+        bool found = next != curr;
+        curr = next;
+        return found;
+    };
+
+    StrView token;
+    curr = GetTokenAlphaNumeric(curr, token);
+    int32_t first = 0;
+    int32_t last = -1;
+    if (IsEmpty(token) || !expect(":", 1) || !number(first) || !expect("..", 2) || !number(last)
+        || !expect("]", 1) || first < 0 || last < first)
+    {
+        error_raised = true;
+        return curr;
+    }
+    p->index.assign(token.curr, token.sz);
+    p->first_index = first;
+    p->instances = last - first + 1;
+    return curr;
+}
+
+// Parse the processes and declarations of src, returning false on a syntax
+// error, with what was parsed up to it.
+bool csp_parse_source(char const*const src, size_t len, std::vector<std::unique_ptr<CSP_Process>>& processes,
+                      std::map<std::string, int, std::less<>>& priority_decls,
+                      std::map<std::string, int, std::less<>>& coalesce_decls)
+{
+    using namespace lab::Text;
+    StrView curr{src, len};
+    curr = SkipCommentsAndWhitespace(curr);
+    bool error_raised = false;
+    while (!IsEmpty(curr) && !error_raised)
+    {
+        StrView token;
+        curr = GetTokenAlphaNumeric(curr, token);
+        if (curr == token)
+        {
+            error_raised = true;
+            break;
+        }
+
+        StrView name = token;
+        curr = SkipCommentsAndWhitespace(curr);
+
+        // an indexed family, NAME[i:first..last] = (...)
+        CSP_Process header;
+        token = Expect(curr, StrView{"[", 1});
+        if (token != curr)
+        {
+            curr = parse_csp_family(token, &header, error_raised);
+            if (error_raised)
+                break;
+            curr = SkipCommentsAndWhitespace(curr);
+        }
+
+        token = Expect(curr, StrView{"=", 1});
+        if (token == curr)
+        {
+            if (header.instances)
+            {
+                error_raised = true;
+                break;
+            }
+
+            // not a process, so it must be a declaration, either
+            // priority class (events) or coalesce mode (events)
+            int value = -1;
+            std::map<std::string, int, std::less<>>* decls = nullptr;
+            curr = GetTokenAlphaNumeric(curr, token);
+            if (name == StrView{"priority", 8})
+            {
+                value = csp_find_name(token, csp_priority_names, CSP_PRIORITY_COUNT);
+                decls = &priority_decls;
+            }
+            else if (name == StrView{"coalesce", 8})
+            {
+                value = csp_find_name(token, csp_coalesce_names, CSP_COALESCE_MODE_COUNT);
+                decls = &coalesce_decls;
+            }
+            if (value < 0)
+            {
+                error_raised = true;
+                break;
+            }
+            curr = SkipCommentsAndWhitespace(curr);
+            curr = parse_csp_event_list(curr, *decls, value, error_raised);
+            curr = SkipCommentsAndWhitespace(curr);
+            continue;
+        }
+
+        CSP_Process* p = new CSP_Process(std::move(header));
+        p->name.assign(name.curr, name.sz);
+        processes.emplace_back(std::unique_ptr<CSP_Process>(p));
+
+        curr = SkipCommentsAndWhitespace(token);
+        token = Expect(curr, StrView{"(", 1});
+        if (token == curr)
+        {
+            if (p->instances)
+                error_raised = true;
+            else
+                curr = parse_csp_composition(curr, p, error_raised);
+            continue;
+        }
+
+        curr = SkipCommentsAndWhitespace(token);
+        curr = parse_csp_process(curr, p, 0, error_raised);
+        curr = SkipCommentsAndWhitespace(curr);
+    }
+    return !error_raised;
+}
+
+// merge into an existing csp, or return a new one if supplied with nullptr.
+// The merged processes start in their initial states, unless named with a
+// leading underscore, while the processes already there carry on. Nothing is
+// merged if a composition names a component that isn't an ordinary process.
+CSP* csp_parse(CSP* csp, char const*const src, size_t len)
+{
+    if (!csp)
+        csp = new CSP();
+
+    std::vector<std::unique_ptr<CSP_Process>> processes;
+    std::map<std::string, int, std::less<>> priority_decls;
+    std::map<std::string, int, std::less<>> coalesce_decls;
+    csp_parse_source(src, len, processes, priority_decls, coalesce_decls);
+    csp_build(csp, std::move(processes), priority_decls, coalesce_decls, true);
+    return csp;
+}
+
+// Replace the processes of a running csp with those defined by src. A
+// process whose definition is unchanged carries on in the state it was in,
+// timeouts included, while changed and new processes start afresh and
+// processes no longer defined stop. Declarations in src are added to those
+// already made. The new processes are compiled on the calling thread while
+// events continue to be dispatched. Returns false, leaving the csp as it
+// was, if src doesn't parse or a composition names a component that isn't
+// an ordinary process.
+bool csp_reload(CSP* csp, char const*const src, size_t len)
+{
+    if (!csp || !src)
+        return false;
+
+    std::vector<std::unique_ptr<CSP_Process>> processes;
+    std::map<std::string, int, std::less<>> priority_decls;
+    std::map<std::string, int, std::less<>> coalesce_decls;
+    if (!csp_parse_source(src, len, processes, priority_decls, coalesce_decls))
+        return false;
+
+    return csp_build(csp, std::move(processes), priority_decls, coalesce_decls, false);
+}
+
+// Add events to the alphabet that no process need engage in, so that they
+// can be emitted for coroutine processes, see csp_coro.h. The events stay
+// subscribed to across reloads, whether or not a process engages in them.
+void csp_add_events(CSP* csp, std::initializer_list<const char*> names)
+{
+    if (!csp)
+        return;
+
+    std::lock_guard<std::mutex> publishing(csp->publish_mutex);
+    std::unique_lock<std::mutex> lock(csp->process_data_mutex);
+    const CSP_Program* current = csp_program(csp);
+    auto subscribed = [current](const char* name)
+    {
+        auto it = current->alphabet->ids.find(name);
+        return it != current->alphabet->ids.end() && current->event_subscribed[it->second];
+    };
+    for (const char* name : names)
+        csp->event_subscriptions.insert(name);
+    if (std::all_of(names.begin(), names.end(), subscribed))
+        return;
+
+    // the alphabet is copied only if an event is new to it
+    CSP_Program* program = new CSP_Program(*current);
+    auto known = [current](const char* name) { return current->alphabet->ids.count(name) != 0; };
+    if (!std::all_of(names.begin(), names.end(), known))
+    {
+        auto alphabet = std::make_shared<CSP_Alphabet>(*current->alphabet);
+        for (const char* name : names)
+            csp_intern_event(alphabet.get(), name);
+        program->alphabet = std::move(alphabet);
+    }
+    program->event_coalesced.resize(program->alphabet->names.size());
+    csp_apply_decls(csp, program);
+    csp_replace_program(csp, program);
+}
+
+// returns the id of a named event, or -1 if it is not in the alphabet.
+// The id is valid for the lifetime of the csp, and may be passed to csp_emit
+// to avoid the lookup. It stays in the alphabet once no process engages in
+// it any more, but is no longer subscribed to, see csp_emit.
+int csp_find_event(CSP* csp, char const*const name)
+{
+    if (!csp || !name)
+        return -1;
+
+    CSP_ProgramRead read(csp);
+    auto it = read.program->alphabet->ids.find(name);
+    if (it == read.program->alphabet->ids.end())
+        return -1;
+    return it->second;
+}
+
+// Publish a copy of the slot table with the lambda in slot, or the slot
+// unbound if lambda is null. Dispatch may be calling from the table being
+// replaced, so it is retired rather than deleted. slot_mutex must be held.
+void csp_publish_slot(CSP* csp, int slot, std::shared_ptr<const CSP_Slot> lambda)
+{
+    CSP_SlotTable* table = new CSP_SlotTable(*csp->slots.load(std::memory_order_relaxed));
+    if (table->lambdas.size() <= size_t(slot))
+        table->lambdas.resize(slot + 1);
+    table->lambdas[slot] = std::move(lambda);
+    csp_retire(csp, csp->retired_slots, csp->slots.exchange(table));
+    csp_reclaim_slots(csp);
+}
+
+// binding never waits for dispatch, so lambdas may be bound from within
+// lambdas, and while a long update is running on another thread
+int csp_bind_slot(CSP* csp, char const*const name, CSP_Slot&& lambda)
+{
+    std::lock_guard<std::mutex> binding(csp->slot_mutex);
+    int slot = csp_intern_slot(csp, name);
+    csp_publish_slot(csp, slot, std::make_shared<const CSP_Slot>(std::move(lambda)));
+    return slot;
+}
+
+// publish the program again with the declarations as they now are, sharing
+// the alphabet and tables of the current one
+void csp_redeclare(CSP* csp)
+{
+    std::lock_guard<std::mutex> publishing(csp->publish_mutex);
+    std::unique_lock<std::mutex> lock(csp->process_data_mutex);
+    CSP_Program* program = new CSP_Program(*csp_program(csp));
+    csp_apply_decls(csp, program);
+    csp_replace_program(csp, program);
+}
+
+// events can also be given a priority in the DSL, as priority high (quit)
+void csp_set_event_priority(CSP* csp, char const*const name, int priority)
+{
+    if (!csp || !name || priority < 0 || priority >= CSP_PRIORITY_COUNT)
+        return;
+
+    {
+        std::unique_lock<std::mutex> lock(csp->process_data_mutex);
+        csp->event_priority_decls[name] = priority;
+    }
+    csp_redeclare(csp);
+}
+
+// events can also be coalesced in the DSL, as coalesce latest (progress).
+// The mode should be set before the event is emitted.
+void csp_set_event_coalescing(CSP* csp, char const*const name, int mode)
+{
+    if (!csp || !name || mode < 0 || mode >= CSP_COALESCE_MODE_COUNT)
+        return;
+
+    {
+        std::unique_lock<std::mutex> lock(csp->process_data_mutex);
+        csp->event_coalesce_decls[name] = mode;
+    }
+    csp_redeclare(csp);
+}
+
+// a weight of zero, the default, gives a lane strict priority over lower lanes
+void csp_set_priority_weight(CSP* csp, int priority, size_t weight)
+{
+    if (!csp || priority < 0 || priority >= CSP_PRIORITY_COUNT)
+        return;
+
+    std::unique_lock<std::mutex> lock(csp->process_data_mutex);
+    csp->lanes[priority].weight = weight;
+    csp->lanes[priority].credit = weight;
+}
+
+// returns the slot the lambda is bound to, which can be used to rebind the
+// output without a name lookup. Processes parsed later that output the name
+// call the same slot.
+int csp_bind_lambda(CSP* csp, char const*const name, std::function<void(int)> fn)
+{
+    if (!csp || !name || !fn)
+        return -1;
+
+    CSP_Slot slot;
+    slot.fn = std::move(fn);
+    return csp_bind_slot(csp, name, std::move(slot));
+}
+
+// bind a lambda taking a T, which receives the inline payload of the event.
+// If an event's payload is not a T, the lambda is not called.
+template <typename T, typename F>
+int csp_bind_payload_lambda(CSP* csp, char const*const name, F fn)
+{
+    if (!csp || !name)
+        return -1;
+
+    CSP_Slot slot;
+    slot.payload_fn = [fn](const CSP_Payload& p)
+    {
+        T value;
+        if (csp_payload_get(p, value))
+            fn(value);
+    };
+    return csp_bind_slot(csp, name, std::move(slot));
+}
+
+// Bind a lambda that runs on the worker pool rather than the thread
+// dispatching events, for outputs too slow to run there. The calls made by
+// a process run one at a time, in order; calls made by different processes
+// may run concurrently. If done names an event, it is emitted with the id
+// and payload of the event once the lambda returns.
+int csp_bind_worker_lambda(CSP* csp, char const*const name, std::function<void(int)> fn,
+                           char const*const done = nullptr)
+{
+    if (!csp || !name || !fn)
+        return -1;
+
+    CSP_Slot slot;
+    slot.fn = std::move(fn);
+    slot.on_worker = true;
+    slot.done = done ? done : "";
+    return csp_bind_slot(csp, name, std::move(slot));
+}
+
+// Bind a lambda that receives the ids of all the events that called the
+// output during a csp_update, in the order they were dispatched, rather than
+// one call per event. The lambda is called once the update has dispatched
+// its events, so it runs after the lambdas of events dispatched later.
+int csp_bind_batch_lambda(CSP* csp, char const*const name, std::function<void(const int*, size_t)> fn)
+{
+    if (!csp || !name || !fn)
+        return -1;
+
+    CSP_Slot slot;
+    slot.batch_fn = std::move(fn);
+    return csp_bind_slot(csp, name, std::move(slot));
+}
+
+// as csp_bind_batch_lambda, with the payloads of the events
+int csp_bind_batch_payload_lambda(CSP* csp, char const*const name, std::function<void(const CSP_Payload*, size_t)> fn)
+{
+    if (!csp || !name || !fn)
+        return -1;
+
+    CSP_Slot slot;
+    slot.batch_payload_fn = std::move(fn);
+    return csp_bind_slot(csp, name, std::move(slot));
+}
+
+// replace the lambda in a slot; an empty fn unbinds the output
+void csp_bind_lambda(CSP* csp, int slot, std::function<void(int)> fn)
+{
+    if (!csp)
+        return;
+
+    std::lock_guard<std::mutex> binding(csp->slot_mutex);
+    if (slot < 0 || size_t(slot) >= csp->lambda_slots.size())
+        return;
+    std::shared_ptr<CSP_Slot> lambda;
+    if (fn)
+    {
+        lambda = std::make_shared<CSP_Slot>();
+        lambda->fn = std::move(fn);
+    }
+    csp_publish_slot(csp, slot, std::move(lambda));
+}
+
+// wake the dispatcher thread if it is waiting for events. The fence orders
+// the preceding enqueue before the check, pairing with the fence in
+// csp_dispatcher_run, so that either the dispatcher sees the event or this
+// sees the dispatcher waiting.
+void csp_signal(CSP* csp)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (csp->dispatcher_waiting.load(std::memory_order_relaxed))
+    {
+        std::lock_guard<std::mutex> lock(csp->dispatcher_mutex);
+        csp->dispatcher_wake.notify_one();
+    }
+}
+
+// the priority of an event, or -1 if it is not in the alphabet
+int csp_event_priority(const CSP_Program* program, int event)
+{
+    if (event < 0 || size_t(event) >= program->event_priority.size())
+        return -1;
+    return program->event_priority[event];
+}
+
+CSP_Coalesced* csp_event_coalesced(const CSP_Program* program, int event)
+{
+    CSP_Coalesced* c = program->event_coalesced[event].get();
+    return c && c->mode != CSP_COALESCE_NONE ? c : nullptr;
+}
+
+// fold an event into its pending instance if it coalesces. Returns true if
+// the event must be enqueued, either because it doesn't coalesce or because
+// no instance is pending.
+bool csp_coalesce(const CSP_Program* program, const CSP_Event& event)
+{
+    CSP_Coalesced* c = csp_event_coalesced(program, event.event);
+    if (!c)
+        return true;
+
+    bool first;
+    if (c->mode == CSP_COALESCE_COUNT)
+        first = c->count.fetch_add(1) == 0;
+    else
+    {
+        std::lock_guard<std::mutex> lock(c->latest_mutex);
+        c->latest = event;
+        first = c->count.fetch_add(1) == 0;
+    }
+    if (first)
+        c->unreserved.fetch_add(1);
+    return first;
+}
+
+// Take the folded instances of a dequeued event, so that emits from here on
+// enqueue a new instance. The instances are taken if any are pending, even
+// if the event no longer coalesces, so that its count never goes stale.
+void csp_collect(const CSP_Program* program, CSP_Event& event)
+{
+    if (event.event < 0 || size_t(event.event) >= program->event_coalesced.size())
+        return;
+
+    CSP_Coalesced* c = program->event_coalesced[event.event].get();
+    if (!c || !c->count.load())
+        return;
+
+    std::lock_guard<std::mutex> lock(c->latest_mutex);
+    int count = c->count.exchange(0);
+    if (!count)
+        return;
+    if (c->mode == CSP_COALESCE_COUNT)
+        event.id = count;
+    else if (c->mode == CSP_COALESCE_LATEST && c->latest.event == event.event)
+        event = c->latest;
+}
+
+// whether a dequeued event was enqueued without counting against the
+// capacity, as the pending instance of a coalescing event is
+bool csp_unreserved(const CSP_Program* program, int event)
+{
+    if (event < 0 || size_t(event) >= program->event_coalesced.size())
+        return false;
+
+    CSP_Coalesced* c = program->event_coalesced[event].get();
+    if (!c)
+        return false;
+    int n = c->unreserved.load(std::memory_order_relaxed);
+    while (n > 0 && !c->unreserved.compare_exchange_weak(n, n - 1)) {}
+    return n > 0;
+}
+
+// Discard an old event from the lowest priority lane that has one, returning
+// false if there were none. Pending instances of coalescing events found on
+// the way are dropped too, and counted as dropped, but they gave no room
+// back, so the search continues.
+bool csp_drop_oldest(CSP* csp, const CSP_Program* program)
+{
+    CSP_Event event;
+    for (int i = CSP_PRIORITY_COUNT - 1; i >= 0; --i)
+    {
+        while (csp->lanes[i].q.try_dequeue(event))
+        {
+            csp->dropped.fetch_add(1, std::memory_order_relaxed);
+            if (csp_unreserved(program, event.event))
+            {
+                csp_collect(program, event);
+                continue;
+            }
+            csp->queued.fetch_sub(1);
+            return true;
+        }
+    }
+    return false;
+}
+
+void csp_wait_for_room(CSP* csp, long long capacity, size_t n)
+{
+    std::unique_lock<std::mutex> lock(csp->room_mutex);
+    csp->room_waiters.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    csp->room_available.wait(lock, [csp, capacity, n]()
+    {
+        long long q = csp->queued.load();
+        return capacity - q >= (long long) n || q <= 0 || csp->capacity.load() != capacity;
+    });
+    csp->room_waiters.fetch_sub(1, std::memory_order_relaxed);
+}
+
+// count n events against the capacity, applying the backpressure policy if
+// they don't fit. Returns how many of them may be enqueued.
+size_t csp_reserve(CSP* csp, const CSP_Program* program, size_t n)
+{
+    long long capacity = csp->capacity.load(std::memory_order_relaxed);
+    if (!capacity)
+        return n;
+
+    int policy = csp->backpressure.load(std::memory_order_relaxed);
+    if (policy == CSP_BACKPRESSURE_DROP_OLDEST)
+    {
+        long long over = csp->queued.fetch_add(n) + (long long) n - capacity;
+        for (; over > 0 && csp_drop_oldest(csp, program); --over) {}
+        return n;
+    }
+
+    bool waited = false;
+    long long q = csp->queued.load();
+    while (true)
+    {
+        long long room = capacity - q;
+        if (room >= (long long) n || q <= 0)
+        {
+            if (csp->queued.compare_exchange_weak(q, q + n))
+                return n;
+            continue;
+        }
+
+        switch (policy)
+        {
+        case CSP_BACKPRESSURE_DROP_NEWEST:
+            if (room <= 0)
+            {
+                csp->dropped.fetch_add(n, std::memory_order_relaxed);
+                return 0;
+            }
+            if (!csp->queued.compare_exchange_weak(q, q + room))
                 continue;
+            csp->dropped.fetch_add(n - room, std::memory_order_relaxed);
+            return size_t(room);
+
+        case CSP_BACKPRESSURE_FAIL:
+            csp->refused.fetch_add(n, std::memory_order_relaxed);
+            return 0;
+
+        default:
+            // blocking the dispatching thread would deadlock it, and
+            // blocking a worker would deadlock csp_stop_workers joining it,
+            // so their emits are let through over capacity
+            if (csp->dispatch_thread.load() == std::this_thread::get_id() || csp_dispatch_pool_owner() == csp
+                || csp_worker_owner() == csp)
+            {
+                csp->queued.fetch_add(n);
+                return n;
+            }
+            if (!waited)
+            {
+                csp->blocked.fetch_add(1, std::memory_order_relaxed);
+                waited = true;
+            }
+            csp_wait_for_room(csp, capacity, n);
+            q = csp->queued.load();
+            break;
+        }
+    }
+}
+
+// return dequeued events' room to blocked emitters. The instances enqueued
+// without a reservation are accounted for even when the capacity is
+// unbounded, so that they are not taken for reserved ones once it is bounded.
+void csp_release(CSP* csp, const CSP_Program* program, const CSP_Event* events, size_t n)
+{
+    long long counted = 0;
+    for (size_t i = 0; i < n; ++i)
+        if (!csp_unreserved(program, events[i].event))
+            ++counted;
+    if (!csp->capacity.load(std::memory_order_relaxed))
+        return;
+    csp->queued.fetch_sub(counted);
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (csp->room_waiters.load(std::memory_order_relaxed))
+    {
+        std::lock_guard<std::mutex> lock(csp->room_mutex);
+        csp->room_available.notify_all();
+    }
+}
+
+// count an emit of an event that nothing subscribes to
+void csp_dead_letter(CSP* csp, const CSP_Program* program, int event)
+{
+    csp->dead_letters.fetch_add(1, std::memory_order_relaxed);
+    if (event >= 0 && size_t(event) < program->event_dead_letters.size())
+        program->event_dead_letters[event]->fetch_add(1, std::memory_order_relaxed);
+}
+
+// count an emit by a name outside the alphabet
+void csp_dead_letter(CSP* csp, char const*const name)
+{
+    csp->dead_letters.fetch_add(1, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(csp->dead_letter_mutex);
+    auto it = csp->unknown_dead_letters.find(name);
+    if (it == csp->unknown_dead_letters.end())
+        it = csp->unknown_dead_letters.emplace(name, 0).first;
+    ++it->second;
+}
+
+// Hand runs of events bound for the same lane to enqueue(priority, first, count),
+// within the capacity of the lanes. Events that nothing subscribes to are
+// dropped as dead letters, and coalescing events are handed on one at a
+// time, if at all. Returns the number of events that were queued, or folded
+// into a pending event.
+template <typename F>
+size_t csp_emit_runs(CSP* csp, const CSP_Event* events, size_t count, F&& enqueue)
+{
+    CSP_ProgramRead read(csp);
+    const CSP_Program* program = read.program;
+    size_t accepted = 0;
+    size_t run = 0;
+    int run_priority = -1;
+    for (size_t i = 0; i <= count; ++i)
+    {
+        int priority = i < count ? csp_event_priority(program, events[i].event) : -1;
+        if (i < count && (priority < 0 || !program->event_subscribed[events[i].event]))
+        {
+            csp_dead_letter(csp, program, events[i].event);
+            priority = -1;
+        }
+        bool coalesced = priority >= 0 && csp_event_coalesced(program, events[i].event);
+        if (i == count || coalesced || priority != run_priority)
+        {
+            if (run_priority >= 0 && i > run)
+            {
+                size_t n = csp_reserve(csp, program, i - run);
+                if (n)
+                    enqueue(run_priority, events + run, n);
+                accepted += n;
+            }
+            run = i;
+            run_priority = priority;
+        }
+        if (coalesced)
+        {
+            if (csp_coalesce(program, events[i]))
+                enqueue(priority, events + i, 1);
+            ++accepted;
+            run = i + 1;
+            run_priority = -1;
+        }
+    }
+    return accepted;
+}
+
+// returns false if the event was not queued, either because nothing
+// subscribes to it, or because there was no room for it
+bool csp_emit(CSP* csp, int event, int id, const CSP_Payload& payload = {})
+{
+    if (!csp)
+        return false;
+
+    CSP_Event e{event, id, payload};
+    size_t accepted = csp_emit_runs(csp, &e, 1, [csp](int priority, const CSP_Event* first, size_t)
+    {
+        csp->lanes[priority].q.enqueue(*first);
+    });
+    csp_signal(csp);
+    return accepted == 1;
+}
+
+// events outside the alphabet of every process can never be engaged, and are
+// discarded here rather than enqueued
+bool csp_emit(CSP* csp, char const*const name, int id, const CSP_Payload& payload = {})
+{
+    if (!csp || !name)
+        return false;
+    int event = csp_find_event(csp, name);
+    if (event < 0)
+    {
+        csp_dead_letter(csp, name);
+        return false;
+    }
+    return csp_emit(csp, event, id, payload);
+}
+
+// enqueue count events, with ids from csp_find_event. Each run of events
+// of the same priority is enqueued at once. Returns the number queued.
+size_t csp_emit_bulk(CSP* csp, const CSP_Event* events, size_t count)
+{
+    if (!csp || !events || !count)
+        return 0;
+
+    size_t accepted = csp_emit_runs(csp, events, count, [csp](int priority, const CSP_Event* first, size_t n)
+    {
+        csp->lanes[priority].q.enqueue_bulk(first, n);
+    });
+    csp_signal(csp);
+    return accepted;
+}
+
+// A producer is registered by a thread that emits often. Its emits use the
+// queue's explicit producer path, avoiding the per-enqueue lookup of the
+// calling thread's implicit producer. A producer must only be used by one
+// thread at a time, and must be unregistered before the csp is deleted.
+struct CSP_Producer
+{
+    explicit CSP_Producer(CSP* csp) : csp(csp)
+    {
+        tokens.reserve(CSP_PRIORITY_COUNT);
+        for (auto& lane : csp->lanes)
+            tokens.emplace_back(lane.q);
+    }
+
+    CSP* csp;
+    std::vector<moodycamel::ProducerToken> tokens;  // one per lane
+};
+
+CSP_Producer* csp_register_producer(CSP* csp)
+{
+    if (!csp)
+        return nullptr;
+    return new CSP_Producer(csp);
+}
+
+void csp_unregister_producer(CSP_Producer* producer)
+{
+    delete producer;
+}
+
+bool csp_emit(CSP_Producer* producer, int event, int id, const CSP_Payload& payload = {})
+{
+    if (!producer)
+        return false;
+
+    CSP_Event e{event, id, payload};
+    size_t accepted = csp_emit_runs(producer->csp, &e, 1, [producer](int priority, const CSP_Event* first, size_t)
+    {
+        producer->csp->lanes[priority].q.enqueue(producer->tokens[priority], *first);
+    });
+    csp_signal(producer->csp);
+    return accepted == 1;
+}
+
+bool csp_emit(CSP_Producer* producer, char const*const name, int id, const CSP_Payload& payload = {})
+{
+    if (!producer || !name)
+        return false;
+    int event = csp_find_event(producer->csp, name);
+    if (event < 0)
+    {
+        csp_dead_letter(producer->csp, name);
+        return false;
+    }
+    return csp_emit(producer, event, id, payload);
+}
+
+size_t csp_emit_bulk(CSP_Producer* producer, const CSP_Event* events, size_t count)
+{
+    if (!producer || !events || !count)
+        return 0;
+
+    size_t accepted = csp_emit_runs(producer->csp, events, count, [producer](int priority, const CSP_Event* first, size_t n)
+    {
+        producer->csp->lanes[priority].q.enqueue_bulk(producer->tokens[priority], first, n);
+    });
+    csp_signal(producer->csp);
+    return accepted;
+}
+
+// Emit an event after delay, and then every period if period is nonzero.
+// Timers are advanced by csp_update, so they fire no more often than the csp
+// is updated, and with a dispatcher thread, to within CSP_TIMER_RESOLUTION.
+// Returns a handle for csp_cancel_timer, or zero if the event is not in
+// the alphabet.
+uint64_t csp_schedule(CSP* csp, int event, int id, std::chrono::microseconds delay,
+                      std::chrono::microseconds period = std::chrono::microseconds(0),
+                      const CSP_Payload& payload = {})
+{
+    if (!csp)
+        return 0;
+    {
+        CSP_ProgramRead read(csp);
+        if (csp_event_priority(read.program, event) < 0)
+            return 0;
+    }
+
+    CSP_Timer timer;
+    timer.event = CSP_Event{event, id, payload};
+    timer.period = csp_timer_ticks(period);
+    uint64_t handle;
+    {
+        std::lock_guard<std::mutex> lock(csp->timers.mutex);
+        timer.expiry = csp_timer_tick(csp->timers, CSP_Clock::now()) + csp_timer_ticks(delay);
+        handle = csp_timer_add(csp->timers, timer);
+    }
+    csp->timers_changed = true;
+    csp_signal(csp);
+    return handle;
+}
+
+uint64_t csp_schedule(CSP* csp, char const*const name, int id, std::chrono::microseconds delay,
+                      std::chrono::microseconds period = std::chrono::microseconds(0),
+                      const CSP_Payload& payload = {})
+{
+    if (!csp || !name)
+        return 0;
+    return csp_schedule(csp, csp_find_event(csp, name), id, delay, period, payload);
+}
 
-            // transition to the new behavior if there is one.
-            csp->process_active[i] = false;
-            for (int j = 0; j < sz; ++j)
-                if (csp->processes[j]->name == p->behavior)
-                    csp->process_active[j] = 2; // set to pending
+// returns false if the timer already fired, for a one shot timer, or was
+// already cancelled. A periodic timer stops repeating.
+bool csp_cancel_timer(CSP* csp, uint64_t timer)
+{
+    if (!csp || !timer)
+        return false;
+
+    std::lock_guard<std::mutex> lock(csp->timers.mutex);
+    return csp_timer_remove(csp->timers, timer);
+}
+
+void csp_run_slot(const CSP_Slot& slot, const CSP_Event& event)
+{
+    if (slot.fn)
+        slot.fn(event.id);
+    else if (slot.payload_fn)
+        slot.payload_fn(event.payload);
+}
+
+void csp_worker_run(CSP* csp, CSP_Worker* worker)
+{
+    csp_worker_owner() = csp;
+    while (true)
+    {
+        CSP_Task task;
+        {
+            std::unique_lock<std::mutex> lock(worker->mutex);
+            worker->wake.wait(lock, [worker]() { return !worker->tasks.empty() || !worker->run; });
+            if (worker->tasks.empty())
+                return;
+            task = std::move(worker->tasks.front());
+            worker->tasks.pop_front();
+        }
+        csp_run_slot(*task.slot, task.event);
+        if (!task.slot->done.empty())
+            csp_emit(csp, task.slot->done.c_str(), task.event.id, task.event.payload);
+    }
+}
+
+// Start count worker threads for slots bound with csp_bind_worker_lambda,
+// or one per core if count is zero. The pool can't be resized once started,
+// as that would reorder the calls of a process that are in flight.
+void csp_start_workers(CSP* csp, size_t count = 0)
+{
+    if (!csp)
+        return;
+
+    std::lock_guard<std::mutex> lock(csp->workers_mutex);
+    if (!csp->workers.empty())
+        return;
+
+    if (!count)
+        count = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t i = 0; i < count; ++i)
+    {
+        CSP_Worker* worker = new CSP_Worker();
+        csp->workers.emplace_back(worker);
+        worker->thread = std::thread([csp, worker]() { csp_worker_run(csp, worker); });
+    }
+    csp->workers_started.store(true, std::memory_order_release);
+}
+
+// finish the calls already posted to the workers, and stop them
+void csp_stop_workers(CSP* csp)
+{
+    if (!csp)
+        return;
+
+    std::lock_guard<std::mutex> lock(csp->workers_mutex);
+    csp->workers_started = false;
+    for (auto& worker : csp->workers)
+    {
+        {
+            std::lock_guard<std::mutex> tasks(worker->mutex);
+            worker->run = false;
+        }
+        worker->wake.notify_one();
+        worker->thread.join();
+    }
+    csp->workers.clear();
+}
+
+// post a call to the worker of key, so that the calls of a process run in
+// the order it made them
+void csp_post_worker(CSP* csp, size_t key, std::shared_ptr<const CSP_Slot> slot, const CSP_Event& event)
+{
+    if (!csp->workers_started.load(std::memory_order_acquire))
+        csp_start_workers(csp);
+
+    CSP_Worker* worker;
+    {
+        std::lock_guard<std::mutex> lock(csp->workers_mutex);
+        if (csp->workers.empty())
+            return;
+        worker = csp->workers[key % csp->workers.size()].get();
+    }
+    {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        worker->tasks.push_back(CSP_Task{std::move(slot), event});
+    }
+    worker->wake.notify_one();
+}
+
+void csp_run_batch(const CSP_Slot& slot, CSP_Batch& batch)
+{
+    if (slot.batch_fn)
+        slot.batch_fn(batch.ids.data(), batch.ids.size());
+    else
+        slot.batch_payload_fn(batch.payloads.data(), batch.payloads.size());
+    batch.ids.clear();
+    batch.payloads.clear();
+}
+
+// size the batches to the slot table; process_data_mutex must be held
+void csp_prepare_batches(CSP* csp)
+{
+    CSP_Read read(csp);
+    size_t n = csp->slots.load()->lambdas.size();
+    if (csp->slot_batches.size() < n)
+        csp->slot_batches.resize(n);
+}
+
+// deliver the calls buffered for batch slots; process_data_mutex must be held
+void csp_flush_batches(CSP* csp)
+{
+    if (!csp->batches_pending.exchange(false))
+        return;
+
+    for (auto& batch : csp->slot_batches)
+    {
+        if (!batch.slot)
+            continue;
+        auto slot = std::move(batch.slot);
+        csp_run_batch(*slot, batch);
+    }
+}
+
+// buffer a call of a batch slot. Slots bound since the update started, or
+// rebound with a call already buffered, can't wait for the flush.
+void csp_batch(CSP* csp, int slot_index, const std::shared_ptr<const CSP_Slot>& slot, const CSP_Event& event)
+{
+    CSP_Batch single;
+    CSP_Batch& batch = size_t(slot_index) < csp->slot_batches.size() ? csp->slot_batches[slot_index] : single;
+    if (batch.slot != slot)
+    {
+        if (batch.slot)
+            csp_run_batch(*batch.slot, batch);
+        batch.slot = slot;
+    }
+
+    if (slot->batch_fn)
+        batch.ids.push_back(event.id);
+    else
+        batch.payloads.push_back(event.payload);
+
+    if (&batch == &single)
+        csp_run_batch(*slot, single);
+    else
+        csp->batches_pending = true;
+}
+
+// call the lambda in a slot on behalf of the process with worker key, or
+// post it to the process's worker if it is bound to run on the pool
+void csp_call_slot(CSP* csp, int slot_index, const CSP_Event& event, size_t key)
+{
+    if (slot_index < 0)
+        return;
+
+    CSP_Read read(csp);
+    const CSP_SlotTable* table = csp->slots.load();
+    if (size_t(slot_index) >= table->lambdas.size() || !table->lambdas[slot_index])
+        return;
+
+    const auto& slot = table->lambdas[slot_index];
+    if (slot->on_worker)
+        csp_post_worker(csp, key, slot, event);
+    else if (slot->batch_fn || slot->batch_payload_fn)
+        csp_batch(csp, slot_index, slot, event);
+    else
+        csp_run_slot(*slot, event);
+}
+
+// whether every participant of synchronization sync is ready for its event
+bool csp_sync_ready(CSP* csp, const CSP_Tables* tables, int sync)
+{
+    for (int participant = tables->sync_participants[sync]; participant < tables->sync_participants[sync + 1];
+         ++participant)
+    {
+        bool ready = false;
+        for (int s : tables->participant_states[participant])
+            if (csp_state_active(csp, tables, s))
+            {
+                ready = true;
+                break;
+            }
+        if (!ready)
+            return false;
+    }
+    return true;
+}
+
+// instance index of a family leaves its state for target, which it enters
+// once the event has been dispatched, if target is in a family with an
+// instance of that index. A target in an ordinary process becomes pending.
+void csp_enter(CSP* csp, const CSP_Tables* tables, int index, int target)
+{
+    if (target == CSP_STOP)
+        return;
+
+    int f = tables->state_family[target];
+    if (f < 0)
+    {
+        csp_set_bit(csp->state_pending, tables->state_bit[target]);
+        return;
+    }
+    const CSP_Family& family = tables->families[f];
+    int i = index - family.first_index;
+    if (i >= 0 && i < family.instances)
+        csp->instances[f].pending.push_back({i, target - family.first_state});
+}
+
+// Apply an event to the instances of a family in one state of its template.
+// The outputs of an instance are called with its index as the id. An indexed
+// transition costs a lookup of the instance, and any other a pass over the
+// bitset of the instances in the state, a word at a time, so that the
+// instances leaving it as they engage are passed over only once.
+void csp_dispatch_family(CSP* csp, const CSP_Tables* tables, const CSP_FamilyEvent& engaged,
+                         const CSP_Event& event)
+{
+    const CSP_Family& family = tables->families[engaged.family];
+    CSP_Instances& instances = csp->instances[engaged.family];
+    int local = engaged.state - family.first_state;
+    const CSP_Edge& edge = *csp_edge(tables, engaged.state, event.event);
+    auto engage = [&](int i)
+    {
+        int index = family.first_index + i;
+        csp_call_slot(csp, edge.slot, CSP_Event{event.event, index, event.payload},
+                      tables->process_keys[family.process] + size_t(index));
+        if (edge.target == engaged.state)
+            return;
+        csp_enter_instance(instances, i, -1);
+        csp_enter(csp, tables, index, edge.target);
+    };
+
+    if (engaged.indexed)
+    {
+        int i = event.id - family.first_index;
+        if (i >= 0 && i < family.instances && instances.state[i] == local)
+            engage(i);
+        return;
+    }
+    const std::vector<uint64_t>& in_state = instances.state_instances[local];
+    for (size_t w = 0; w < in_state.size(); ++w)
+        csp_for_each_bit(in_state[w], int(w * 64), engage);
+}
+
+// apply one event to the active states; process_data_mutex must be held
+void csp_dispatch(CSP* csp, const CSP_Event& event)
+{
+    const CSP_Tables* tables = csp_program(csp)->tables.get();
+    if (event.event < 0 || size_t(event.event) >= tables->event_states.size() || tables->event_group[event.event] < 0)
+        return;
+
+    // a shared event of a composition is refused by all of the components
+    // unless each of them is ready to engage in it
+    int first_sync = tables->event_syncs[event.event];
+    int end_sync = tables->event_syncs[event.event + 1];
+    for (int sync = first_sync; sync < end_sync; ++sync)
+    {
+        if (csp_sync_ready(csp, tables, sync))
+            continue;
+        for (int participant = tables->sync_participants[sync]; participant < tables->sync_participants[sync + 1];
+             ++participant)
+            for (int s : tables->participant_states[participant])
+                csp_set_bit(csp->state_refused, tables->state_bit[s]);
+    }
+
+    // the states engaging in the event that are active and not refused
+    CSP_Mask mask{size_t(tables->event_first_word[event.event]), tables->event_masks[event.event]};
+    csp_for_each_intersection(mask, csp->state_active, csp->state_refused, [&](int b)
+    {
+        int s = tables->bit_state[b];
+        const CSP_Edge& edge = *csp_edge(tables, s, event.event);
+        csp_call_slot(csp, edge.slot, event, tables->process_keys[tables->state_process[s]]);
+
+        // common case: recur. Engaging the event restarts the timeout.
+        if (edge.target == s)
+        {
+            csp_arm_timeout(csp, s);
+            return;
+        }
+
+        // transition to the new behavior if there is one.
+        csp_transition(csp, tables, s, edge.target);
+    });
+
+    if (first_sync < end_sync)
+        for (int participant = tables->sync_participants[first_sync];
+             participant < tables->sync_participants[end_sync]; ++participant)
+            for (int s : tables->participant_states[participant])
+                csp_clear_bit(csp->state_refused, tables->state_bit[s]);
+    for (const CSP_FamilyEvent& engaged : tables->event_families[event.event])
+        csp_dispatch_family(csp, tables, engaged, event);
+    csp_promote(csp, tables->event_group[event.event]);
+}
+
+// Resume the coroutines awaiting an event; process_data_mutex must be held.
+// A coroutine that awaits the event again waits for its next instance.
+void csp_resume(CSP* csp, const CSP_Event& event)
+{
+    if (event.event < 0 || size_t(event.event) >= csp->event_awaiters.size() || csp->event_awaiters[event.event].empty())
+        return;
+
+    auto& resuming = csp->resuming;
+    resuming.swap(csp->event_awaiters[event.event]);
+    for (auto& awaiter : resuming)
+        awaiter.resume(awaiter.awaiter, event);
+    resuming.clear();
+}
+
+// a state's timeout expired; process_data_mutex must be held. A timeout
+// that was cancelled after it expired, but before it got here, is ignored.
+void csp_timeout(CSP* csp, const CSP_Timer& timer)
+{
+    int s = timer.state;
+    if (s < 0 || size_t(s) >= csp->state_timers.size())
+        return;
+
+    const CSP_Tables* tables = csp_program(csp)->tables.get();
+    if (csp->state_timers[s] != timer.handle || !csp_state_active(csp, tables, s))
+        return;
+
+    const CSP_Timeout& timeout = tables->state_timeouts[s];
+    csp->state_timers[s] = 0;
+    csp_call_slot(csp, timeout.edge.slot, CSP_Event{-1, 0, {}}, tables->process_keys[tables->state_process[s]]);
+    csp_transition(csp, tables, s, timeout.edge.target);
+    csp_promote(csp, tables->state_group[s]);
+}
+
+// advance the timers to now, applying expired timeouts, and emitting the
+// events of expired timers to be dispatched in turn with other events.
+// process_data_mutex must be held.
+void csp_update_timers(CSP* csp)
+{
+    auto& expired = csp->timers.expired;
+    expired.clear();
+    {
+        std::lock_guard<std::mutex> lock(csp->timers.mutex);
+        csp_timer_advance(csp->timers, csp_timer_tick(csp->timers, CSP_Clock::now()), expired);
+    }
+    for (auto& t : expired)
+    {
+        if (t.state >= 0)
+            csp_timeout(csp, t);
+        else
+            csp_emit(csp, t.event.event, t.event.id, t.event.payload);
+    }
+}
+
+// dequeue up to max events into the drain buffer from the highest priority
+// lane that has events and weight credit left. When every lane with events
+// has spent its credit, the credits are renewed.
+size_t csp_dequeue(CSP* csp, size_t max)
+{
+    csp->drain_next = 0;
+    for (int round = 0; round < 2; ++round)
+    {
+        for (auto& lane : csp->lanes)
+        {
+            size_t n = max;
+            if (lane.weight)
+            {
+                if (!lane.credit)
+                    continue;
+                n = std::min(n, lane.credit);
+            }
+            csp->drain.resize(n);
+            n = lane.q.try_dequeue_bulk(lane.consumer, csp->drain.begin(), n);
+            if (n)
+            {
+                if (lane.weight)
+                    lane.credit -= n;
+                csp->drain.resize(n);
+                csp_release(csp, csp_program(csp), csp->drain.data(), n);
+                return n;
+            }
+        }
+        for (auto& lane : csp->lanes)
+            lane.credit = lane.weight;
+    }
+    csp->drain.clear();
+    return 0;
+}
+
+// run jobs until the batch has none left
+void csp_pool_work(CSP_DispatchPool& pool)
+{
+    for (size_t i = pool.next.fetch_add(1); i < pool.job_count; i = pool.next.fetch_add(1))
+        pool.job(i);
+}
+
+void csp_pool_thread(CSP* csp, CSP_DispatchPool* pool)
+{
+    csp_dispatch_pool_owner() = csp;
+    uint64_t batch = 0;
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    while (true)
+    {
+        pool->wake.wait(lock, [pool, batch]() { return pool->batch != batch || !pool->run; });
+        if (!pool->run)
+            return;
+        batch = pool->batch;
+        lock.unlock();
+        csp_pool_work(*pool);
+        lock.lock();
+        if (!--pool->busy)
+            pool->done.notify_one();
+    }
+}
+
+// run job(0) to job(count - 1) across the pool and the calling thread
+void csp_pool_run(CSP_DispatchPool& pool, size_t count, std::function<void(size_t)> job)
+{
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.job = std::move(job);
+        pool.job_count = count;
+        pool.next = 0;
+        pool.busy = pool.threads.size();
+        ++pool.batch;
+    }
+    pool.wake.notify_all();
+    csp_pool_work(pool);
+
+    // every thread must be done with the job before it goes out of scope
+    std::unique_lock<std::mutex> lock(pool.mutex);
+    pool.done.wait(lock, [&pool]() { return !pool.busy; });
+}
+
+// Dispatch n events, bucketed by the group they belong to. Each group's
+// events are dispatched in order on one thread, and the groups in parallel.
+// process_data_mutex must be held.
+void csp_dispatch_groups(CSP* csp, CSP_Event* events, size_t n)
+{
+    const CSP_Program* program = csp_program(csp);
+    const CSP_Tables* tables = program->tables.get();
+    auto& buckets = csp->group_events;
+    if (buckets.size() < tables->group_states.size())
+        buckets.resize(tables->group_states.size());
+
+    csp->busy_groups.clear();
+    for (size_t i = 0; i < n; ++i)
+    {
+        csp_collect(program, events[i]);
+        int e = events[i].event;
+        if (e < 0 || size_t(e) >= tables->event_group.size() || tables->event_group[e] < 0)
+            continue;
+        int group = tables->event_group[e];
+        if (buckets[group].empty())
+            csp->busy_groups.push_back(group);
+        buckets[group].push_back(events + i);
+    }
+
+    auto dispatch = [csp](size_t i)
+    {
+        for (CSP_Event* event : csp->group_events[csp->busy_groups[i]])
+            csp_dispatch(csp, *event);
+    };
+    if (csp->busy_groups.size() == 1)
+        dispatch(0);
+    else if (!csp->busy_groups.empty())
+        csp_pool_run(*csp->dispatch_pool, csp->busy_groups.size(), dispatch);
+
+    for (int group : csp->busy_groups)
+        buckets[group].clear();
+
+    // coroutines belong to no group, and are resumed on this thread
+    if (!csp->coroutines.empty())
+        for (size_t i = 0; i < n; ++i)
+            csp_resume(csp, events[i]);
+}
+
+// dispatch at most max_events events, stopping once max_time has elapsed.
+// A zero limit is no limit. Events that don't fit in the budget are left
+// for the next update. Returns the number of events dispatched.
+size_t csp_update(CSP* csp, size_t max_events, std::chrono::microseconds max_time)
+{
+    if (!csp)
+        return 0;
+
+    auto start = std::chrono::steady_clock::now();
+
+    // guard against adding processes, or changing them
+    std::unique_lock<std::mutex> lock(csp->process_data_mutex);
+    csp->dispatch_thread = std::this_thread::get_id();
+    csp_reclaim(csp);
+    {
+        std::unique_lock<std::mutex> binding(csp->slot_mutex, std::try_to_lock);
+        if (binding)
+            csp_reclaim_slots(csp);
+    }
+    csp_prepare_batches(csp);
+    csp_update_timers(csp);
+    size_t count = 0;
+    bool parallel = csp->dispatch_pool && csp_program(csp)->tables->group_states.size() > 1;
+    while (!max_events || count < max_events)
+    {
+        if (csp->drain_next == csp->drain.size())
+        {
+            // dequeue no more than the budget allows, so that only a time
+            // limit can leave events behind in the drain buffer
+            size_t batch = parallel ? CSP_PARALLEL_BATCH : CSP_DRAIN_BATCH;
+            if (max_events)
+                batch = std::min(batch, max_events - count);
+            if (!csp_dequeue(csp, batch))
+                break;
+        }
+
+        if (parallel)
+        {
+            size_t n = csp->drain.size() - csp->drain_next;
+            if (max_events)
+                n = std::min(n, max_events - count);
+            csp_dispatch_groups(csp, csp->drain.data() + csp->drain_next, n);
+            csp->drain_next += n;
+            count += n;
+        }
+        else
+        {
+            CSP_Event& event = csp->drain[csp->drain_next++];
+            csp_collect(csp_program(csp), event);
+            csp_dispatch(csp, event);
+            csp_resume(csp, event);
+            ++count;
+        }
+
+        if (max_time.count() && std::chrono::steady_clock::now() - start >= max_time)
+            break;
+    }
+    csp_flush_batches(csp);
+    csp->dispatch_thread = std::thread::id();
+    return count;
+}
+
+// dispatch every pending event
+void csp_update(CSP* csp)
+{
+    csp_update(csp, 0, std::chrono::microseconds(0));
+}
+
+// the approximate number of events waiting in the lanes
+size_t csp_queued(CSP* csp)
+{
+    size_t sz = 0;
+    for (auto& lane : csp->lanes)
+        sz += lane.q.size_approx();
+    return sz;
+}
+
+// Bound the number of queued events. When an emit would exceed the capacity,
+// the backpressure policy applies. A capacity of zero is unbounded.
+void csp_set_capacity(CSP* csp, size_t capacity, int backpressure)
+{
+    if (!csp)
+        return;
+
+    // pending coalescing instances hold no reservation, so they don't count
+    long long unreserved = 0;
+    {
+        CSP_ProgramRead read(csp);
+        for (auto& c : read.program->event_coalesced)
+            if (c)
+                unreserved += c->unreserved.load();
+    }
+
+    std::lock_guard<std::mutex> lock(csp->room_mutex);
+    csp->backpressure = backpressure;
+    csp->queued = std::max(0LL, (long long) csp_queued(csp) - unreserved);
+    csp->capacity = (long long) capacity;
+    csp->room_available.notify_all();
+}
+
+CSP_Stats csp_stats(CSP* csp)
+{
+    CSP_Stats stats;
+    if (csp)
+    {
+        stats.dropped = csp->dropped.load();
+        stats.blocked = csp->blocked.load();
+        stats.refused = csp->refused.load();
+        stats.dead_letters = csp->dead_letters.load();
+    }
+    return stats;
+}
+
+// the dead letters of each event name emitted that nothing subscribed to
+std::map<std::string, uint64_t> csp_dead_letters(CSP* csp)
+{
+    std::map<std::string, uint64_t> letters;
+    if (!csp)
+        return letters;
+
+    {
+        CSP_ProgramRead read(csp);
+        const CSP_Program* program = read.program;
+        for (size_t e = 0; e < program->event_dead_letters.size(); ++e)
+            if (uint64_t n = program->event_dead_letters[e]->load(std::memory_order_relaxed))
+                letters[program->alphabet->names[e]] = n;
+    }
+    std::lock_guard<std::mutex> lock(csp->dead_letter_mutex);
+    for (auto& i : csp->unknown_dead_letters)
+        letters[i.first] += i.second;
+    return letters;
+}
+
+void csp_dispatcher_run(CSP* csp)
+{
+    while (csp->dispatcher_run.load())
+    {
+        csp_update(csp);
+
+        std::unique_lock<std::mutex> lock(csp->dispatcher_mutex);
+        csp->dispatcher_waiting.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!csp_queued(csp))
+            csp->dispatcher_idle.notify_all();
+
+        // sleep until an event is emitted, or the next timer may expire
+        auto wake = [csp]()
+        {
+            return csp_queued(csp) || csp->timers_changed.exchange(false) || !csp->dispatcher_run.load();
+        };
+        auto deadline = csp_timer_deadline(csp->timers);
+        if (deadline == CSP_Clock::time_point::max())
+            csp->dispatcher_wake.wait(lock, wake);
+        else
+            csp->dispatcher_wake.wait_until(lock, deadline, wake);
+        csp->dispatcher_waiting.store(false, std::memory_order_relaxed);
+    }
+}
+
+// Run csp_update on a dedicated thread that sleeps until an event is emitted,
+// rather than waiting for the next csp_update from the UI loop. Bound lambdas
+// then run on the dispatcher thread.
+void csp_start_dispatcher(CSP* csp)
+{
+    if (!csp || csp->dispatcher.joinable())
+        return;
+
+    csp->dispatcher_run = true;
+    csp->dispatcher = std::thread([csp]() { csp_dispatcher_run(csp); });
+}
+
+void csp_stop_dispatcher(CSP* csp)
+{
+    if (!csp || !csp->dispatcher.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(csp->dispatcher_mutex);
+        csp->dispatcher_run = false;
+        csp->dispatcher_wake.notify_one();
+    }
+    csp->dispatcher.join();
+}
+
+// Dispatch events on count threads, the updating thread among them, rather
+// than on the updating thread alone. Processes that share no events, no
+// outputs, and no behaviors form independent groups, and each batch of
+// events is split between threads by group. A group's events are dispatched
+// in order, so it behaves as it would dispatched serially, but the lambdas
+// of different groups run concurrently, and must not share data unguarded.
+// A count of zero or one restores serial dispatch, the default.
+void csp_set_dispatch_threads(CSP* csp, size_t count)
+{
+    if (!csp)
+        return;
+
+    std::unique_lock<std::mutex> lock(csp->process_data_mutex);
+    if (auto& pool = csp->dispatch_pool)
+    {
+        {
+            std::lock_guard<std::mutex> stopping(pool->mutex);
+            pool->run = false;
         }
-        for (int i = 0; i < sz; ++i)
-            if (csp->process_active[i] == 2)
-                csp->process_active[i] = 1;     // pending becomes active, to prevent (tick -> (tick -> TOCK)) from firing immediately the second time
+        pool->wake.notify_all();
+        for (auto& thread : pool->threads)
+            thread.join();
+        pool.reset();
+    }
+    if (count < 2)
+        return;
+
+    CSP_DispatchPool* pool = new CSP_DispatchPool();
+    csp->dispatch_pool.reset(pool);
+    for (size_t i = 1; i < count; ++i)
+        pool->threads.emplace_back([csp, pool]() { csp_pool_thread(csp, pool); });
+}
+
+// block until every event emitted so far, and any they lead to, has been
+// dispatched. Without a dispatcher thread, the events are dispatched here.
+void csp_wait_idle(CSP* csp)
+{
+    if (!csp)
+        return;
+
+    if (!csp->dispatcher.joinable())
+    {
+        csp_update(csp);
+        return;
     }
+
+    std::unique_lock<std::mutex> lock(csp->dispatcher_mutex);
+    csp->dispatcher_idle.wait(lock, [csp]()
+    {
+        return (csp->dispatcher_waiting.load() && !csp_queued(csp)) || !csp->dispatcher_run.load();
+    });
 }
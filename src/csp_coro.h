@@ -0,0 +1,126 @@
+#pragma once
+
+#include "csp.h"
+
+// Coroutine processes, for builds with C++20 coroutines. A process with
+// several steps can be written as a function rather than as DSL with
+// lambdas bound to its outputs:
+//
+//     CSP_Coroutine clock(CSP_Context ctx)
+//     {
+//         while (true)
+//         {
+//             co_await ctx.event("tick");
+//             CSP_Event tock = co_await ctx.event("tock");
+//             printf("tock %d\n", tock.id);
+//         }
+//     }
+//
+//     csp_spawn(csp, clock(CSP_Context{csp}), {"tick", "tock"});
+//
+// The coroutine runs on the thread dispatching events, interleaved with the
+// DSL processes, and holds process_data_mutex as bound lambdas do. Awaiting
+// coroutines are indexed by the event they await, so an event resumes its
+// awaiters without searching the others. A coroutine awaiting an event
+// outside the alphabet never resumes, and is destroyed with the csp. Its
+// parameters are copied into its frame, but a lambda coroutine's captures
+// are not, so processes are best written as functions.
+
+#if defined(__cpp_impl_coroutine)
+
+#include <coroutine>
+#include <exception>
+
+struct CSP_Coroutine
+{
+    struct promise_type
+    {
+        CSP_Coroutine get_return_object()
+        {
+            return CSP_Coroutine{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+// resume a coroutine process of csp, destroying it once it has finished;
+// process_data_mutex must be held
+void csp_coroutine_step(CSP* csp, std::coroutine_handle<> handle)
+{
+    handle.resume();
+    if (!handle.done())
+        return;
+
+    csp->coroutines.erase(handle.address());
+    handle.destroy();
+}
+
+// awaits the next instance of an event, and returns it
+struct CSP_EventAwaiter
+{
+    CSP* csp;
+    int event_id;
+    CSP_Event event;
+    std::coroutine_handle<> handle;
+
+    static void resume(void* awaiter, const CSP_Event& event)
+    {
+        auto a = static_cast<CSP_EventAwaiter*>(awaiter);
+        a->event = event;
+        csp_coroutine_step(a->csp, a->handle);
+    }
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        handle = h;
+        if (event_id < 0)
+            return;
+
+        auto& awaiters = csp->event_awaiters;
+        if (event_id >= awaiters.size())
+            awaiters.resize(event_id + 1);
+        awaiters[event_id].push_back(CSP_Awaiter{&CSP_EventAwaiter::resume, this});
+    }
+    CSP_Event await_resume() const noexcept { return event; }
+};
+
+struct CSP_Context
+{
+    CSP* csp;
+
+    CSP_EventAwaiter event(int id) const { return CSP_EventAwaiter{csp, id, {}, {}}; }
+    CSP_EventAwaiter event(char const*const name) const { return event(csp_find_event(csp, name)); }
+};
+
+// Start a coroutine process, which runs until it first awaits an event.
+// events are added to the alphabet beforehand, for coroutines awaiting
+// events that no DSL process engages in, or may not after a reload; emits
+// of an event nothing subscribes to are dropped. Like csp_parse, spawning must not
+// happen from within a lambda or a coroutine process.
+void csp_spawn(CSP* csp, CSP_Coroutine coroutine, std::initializer_list<const char*> events = {})
+{
+    std::coroutine_handle<> handle = coroutine.handle;
+    if (!handle)
+        return;
+    if (!csp)
+    {
+        handle.destroy();
+        return;
+    }
+
+    csp_add_events(csp, events);
+    std::lock_guard<std::mutex> lock(csp->process_data_mutex);
+    csp->coroutines[handle.address()] = [](void* frame)
+    {
+        std::coroutine_handle<>::from_address(frame).destroy();
+    };
+    csp_coroutine_step(csp, handle);
+}
+
+#endif
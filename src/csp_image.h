@@ -0,0 +1,813 @@
+#pragma once
+
+#include "csp.h"
+#include <cstdio>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A precompiled image of a parsed and linked csp: its string table, the
+// tables csp_dispatch consults as csp_compile and csp_group laid them out,
+// and the processes they were compiled from. Loading an image maps the
+// file, and the tables view their arrays in the mapping, with no
+// tokenizing and no copy or allocation per process or state. The image
+// records a hash of the source it was compiled from, and is stale once the
+// source changes. Images are in native byte order, and are meant as a
+// cache beside the source rather than for distribution.
+constexpr uint32_t CSP_IMAGE_MAGIC = 0x69505343; // "CSPi"
+constexpr uint32_t CSP_IMAGE_VERSION = 3;
+
+// The sections of an image, each an array of 32 bit words, or of 64 bit
+// words for the bitsets, which start on a 64 bit boundary. Strings are
+// referred to by their index in the string table, or -1 if empty. Rows
+// are laid out as in CSP_Rows.
+enum CSP_ImageSection : int
+{
+    CSP_IMAGE_STRING_OFFSETS = 0,   // string count + 1 offsets into the characters
+    CSP_IMAGE_STRING_CHARS,         // the characters of the strings, padded
+    CSP_IMAGE_EVENTS,               // the name of each event id
+    CSP_IMAGE_SLOTS,                // the output name of each lambda slot
+    CSP_IMAGE_PROCESSES,            // a CSP_ImageProcess per process
+    CSP_IMAGE_PREFIXES,             // a CSP_ImagePrefix per prefix
+    CSP_IMAGE_COMPONENTS,           // the name of each component
+    CSP_IMAGE_STATE_ROWS,           // state count + 1 offsets into the transitions
+    CSP_IMAGE_TRANSITIONS,          // a CSP_Transition per transition, in rows
+    CSP_IMAGE_STATE_PROCESS,        // the process of each state
+    CSP_IMAGE_TIMEOUTS,             // a CSP_Timeout per state
+    CSP_IMAGE_EVENT_STATES,         // event count + 1 offsets, then the states
+    CSP_IMAGE_STATE_FORKS,          // state count + 1 offsets, then the states
+    CSP_IMAGE_EVENT_SYNCS,          // event count + 1 offsets into the syncs
+    CSP_IMAGE_SYNC_PARTICIPANTS,    // sync count + 1 offsets into the participants
+    CSP_IMAGE_PARTICIPANT_STATES,   // participant count + 1 offsets, then the states
+    CSP_IMAGE_GROUP_STATES,         // group count + 1 offsets, then the states
+    CSP_IMAGE_STATE_GROUP,          // the group of each state
+    CSP_IMAGE_EVENT_GROUP,          // the group of each event, or -1
+    CSP_IMAGE_STATE_BIT,            // the bit of each state
+    CSP_IMAGE_BIT_STATE,            // the state of each bit, or -1
+    CSP_IMAGE_GROUP_WORDS,          // group count + 1 offsets into the words of the bitsets
+    CSP_IMAGE_EVENT_FIRST_WORD,     // the first word of the mask of each event
+    CSP_IMAGE_EVENT_MASK_ROWS,      // event count + 1 offsets into the mask words
+    CSP_IMAGE_MASK_WORDS,           // 64 bit, the words of the masks of the events
+    CSP_IMAGE_FORK_BITS,            // 64 bit, the states that start a composition
+    CSP_IMAGE_TIMED_BITS,           // 64 bit, the states with a timeout
+    CSP_IMAGE_DECLS,                // kind, event and value per declaration
+    CSP_IMAGE_SECTION_COUNT
+};
+
+struct CSP_ImageHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t source_hash;
+    uint32_t event_count;       // the events compiled into the transitions
+    uint32_t state_count;
+    uint32_t sections[CSP_IMAGE_SECTION_COUNT][2];  // word offset past the header, and word count
+};
+
+struct CSP_ImageProcess
+{
+    int32_t name;
+    int32_t first_state;
+    int32_t state_count;
+    int32_t first_prefix;
+    int32_t prefix_count;
+    int32_t first_component;
+    int32_t component_count;
+};
+
+struct CSP_ImagePrefix
+{
+    int32_t from;
+    int32_t event;
+    int32_t after_ms;
+    int32_t behavior;
+    int32_t to;
+    int32_t out;
+};
+
+static_assert(sizeof(CSP_Transition) == 3 * sizeof(int32_t) && sizeof(CSP_Timeout) == 3 * sizeof(int32_t)
+              && sizeof(int) == sizeof(int32_t) && sizeof(CSP_ImageHeader) % sizeof(uint64_t) == 0,
+              "the tables view the sections of images as they are");
+
+// 64 bit FNV-1a, identifying the source an image was compiled from
+uint64_t csp_source_hash(char const*const src, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; ++i)
+    {
+        hash ^= uint8_t(src[i]);
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// a read only mapping of a whole file
+struct CSP_Mapping
+{
+    ~CSP_Mapping()
+    {
+#if defined(_WIN32)
+        if (data)
+            UnmapViewOfFile(data);
+        if (mapping)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+#else
+        if (data)
+            munmap(const_cast<char*>(data), size);
+#endif
+    }
+
+    char const* data = nullptr;
+    size_t size = 0;
+#if defined(_WIN32)
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+};
+
+std::shared_ptr<CSP_Mapping> csp_map_file(char const*const path)
+{
+    std::shared_ptr<CSP_Mapping> m = std::make_shared<CSP_Mapping>();
+#if defined(_WIN32)
+    m->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m->file == INVALID_HANDLE_VALUE)
+        return nullptr;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m->file, &size) || !size.QuadPart)
+        return nullptr;
+    m->mapping = CreateFileMappingA(m->file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!m->mapping)
+        return nullptr;
+    m->data = static_cast<char const*>(MapViewOfFile(m->mapping, FILE_MAP_READ, 0, 0, 0));
+    m->size = size_t(size.QuadPart);
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        void* data = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            m->data = static_cast<char const*>(data);
+            m->size = size_t(st.st_size);
+        }
+    }
+    close(fd);
+#endif
+    if (!m->data)
+        return nullptr;
+    return m;
+}
+
+// A mapped image, with checked access to its sections
+struct CSP_Image
+{
+    std::shared_ptr<CSP_Mapping> mapping;
+    const CSP_ImageHeader* header = nullptr;
+
+    const int32_t* section(int i) const
+    {
+        return reinterpret_cast<const int32_t*>(header + 1) + header->sections[i][0];
+    }
+    size_t words(int i) const { return header->sections[i][1]; }
+    size_t string_count() const { return words(CSP_IMAGE_STRING_OFFSETS) - 1; }
+
+    std::string_view view(int32_t i) const
+    {
+        if (i < 0)
+            return std::string_view();
+        const int32_t* offsets = section(CSP_IMAGE_STRING_OFFSETS);
+        char const* chars = reinterpret_cast<char const*>(section(CSP_IMAGE_STRING_CHARS));
+        return std::string_view(chars + offsets[i], size_t(offsets[i + 1] - offsets[i]));
+    }
+    std::string string(int32_t i) const { return std::string(view(i)); }
+
+    // the elements of section i from word skip on, in place
+    template <typename T>
+    CSP_Array<T> array(int i, size_t skip = 0) const
+    {
+        return CSP_Array<T>(reinterpret_cast<const T*>(section(i) + skip),
+                            (words(i) - skip) * sizeof(int32_t) / sizeof(T));
+    }
+
+    // the rows of a section of n + 1 offsets followed by the values
+    CSP_Rows<int> rows(int i, size_t n) const
+    {
+        return {CSP_Array<int>(section(i), n + 1), array<int>(i, n + 1)};
+    }
+};
+
+// Check that the image is current for the source hash, that every section
+// lies within the file, and that every value is in range: indices within
+// their tables, states within their processes, and declarations among
+// those the DSL has. The tables are dispatched from as they are, so the
+// groups and bit layout must be those csp_group would accept: every state
+// has the one bit, within the words of its group, and the states that
+// dispatch touches together share a group. A truncated or corrupt image is
+// rejected rather than dispatched from.
+bool csp_image_valid(const CSP_Image& image, uint64_t source_hash)
+{
+    const CSP_ImageHeader* h = image.header;
+    if (image.mapping->size < sizeof(CSP_ImageHeader)
+        || h->magic != CSP_IMAGE_MAGIC || h->version != CSP_IMAGE_VERSION
+        || h->source_hash != source_hash)
+        return false;
+
+    size_t words = (image.mapping->size - sizeof(CSP_ImageHeader)) / sizeof(int32_t);
+    for (int i = 0; i < CSP_IMAGE_SECTION_COUNT; ++i)
+        if (size_t(h->sections[i][0]) + h->sections[i][1] > words)
+            return false;
+    for (int i : { CSP_IMAGE_MASK_WORDS, CSP_IMAGE_FORK_BITS, CSP_IMAGE_TIMED_BITS })
+        if (h->sections[i][0] % 2 || h->sections[i][1] % 2)
+            return false;
+
+    // offsets from 0 to count, in order
+    auto offsets_valid = [](const int32_t* rows, size_t n, size_t count)
+    {
+        if (rows[0] != 0 || size_t(rows[n]) != count)
+            return false;
+        for (size_t i = 0; i < n; ++i)
+            if (rows[i] > rows[i + 1])
+                return false;
+        return true;
+    };
+
+    size_t events = h->event_count;
+    size_t states = h->state_count;
+    if (image.words(CSP_IMAGE_STRING_OFFSETS) < 1
+        || image.words(CSP_IMAGE_EVENTS) != events
+        || image.words(CSP_IMAGE_PROCESSES) % (sizeof(CSP_ImageProcess) / sizeof(int32_t))
+        || image.words(CSP_IMAGE_PREFIXES) % (sizeof(CSP_ImagePrefix) / sizeof(int32_t))
+        || image.words(CSP_IMAGE_STATE_ROWS) != states + 1
+        || image.words(CSP_IMAGE_TRANSITIONS) % (sizeof(CSP_Transition) / sizeof(int32_t))
+        || image.words(CSP_IMAGE_STATE_PROCESS) != states
+        || image.words(CSP_IMAGE_TIMEOUTS) != 3 * states
+        || image.words(CSP_IMAGE_EVENT_STATES) < events + 1
+        || image.words(CSP_IMAGE_STATE_FORKS) < states + 1
+        || image.words(CSP_IMAGE_EVENT_SYNCS) != events + 1
+        || image.words(CSP_IMAGE_SYNC_PARTICIPANTS) < 1
+        || image.words(CSP_IMAGE_PARTICIPANT_STATES) < 1
+        || image.words(CSP_IMAGE_GROUP_STATES) < 1
+        || image.words(CSP_IMAGE_STATE_GROUP) != states
+        || image.words(CSP_IMAGE_EVENT_GROUP) != events
+        || image.words(CSP_IMAGE_STATE_BIT) != states
+        || image.words(CSP_IMAGE_GROUP_WORDS) < 1
+        || image.words(CSP_IMAGE_EVENT_FIRST_WORD) != events
+        || image.words(CSP_IMAGE_EVENT_MASK_ROWS) != events + 1
+        || image.words(CSP_IMAGE_DECLS) % 3)
+        return false;
+
+    // the counts of the syncs, participants, groups, and words of the
+    // bitsets, which size the sections after them
+    size_t syncs = image.words(CSP_IMAGE_SYNC_PARTICIPANTS) - 1;
+    size_t groups = image.words(CSP_IMAGE_GROUP_WORDS) - 1;
+    const int32_t* event_syncs = image.section(CSP_IMAGE_EVENT_SYNCS);
+    const int32_t* sync_participants = image.section(CSP_IMAGE_SYNC_PARTICIPANTS);
+    const int32_t* group_words = image.section(CSP_IMAGE_GROUP_WORDS);
+    if (sync_participants[syncs] < 0)
+        return false;
+    size_t participants = size_t(sync_participants[syncs]);
+    if (!offsets_valid(event_syncs, events, syncs)
+        || !offsets_valid(sync_participants, syncs, participants)
+        || image.words(CSP_IMAGE_PARTICIPANT_STATES) < participants + 1
+        || image.words(CSP_IMAGE_GROUP_STATES) != groups + 1 + states
+        || group_words[groups] < 0 || !offsets_valid(group_words, groups, size_t(group_words[groups])))
+        return false;
+    size_t bit_words = size_t(group_words[groups]);
+    size_t bits = 64 * bit_words;
+    if (image.words(CSP_IMAGE_BIT_STATE) != bits
+        || image.words(CSP_IMAGE_FORK_BITS) != 2 * bit_words
+        || image.words(CSP_IMAGE_TIMED_BITS) != 2 * bit_words)
+        return false;
+
+    size_t strings = image.string_count();
+    size_t chars = image.words(CSP_IMAGE_STRING_CHARS) * sizeof(int32_t);
+    const int32_t* offsets = image.section(CSP_IMAGE_STRING_OFFSETS);
+    for (size_t i = 0; i < strings; ++i)
+        if (offsets[i] < 0 || offsets[i] > offsets[i + 1] || size_t(offsets[i + 1]) > chars)
+            return false;
+
+    auto is_string = [strings](int32_t i) { return i >= -1 && i < int32_t(strings); };
+    auto is_state = [states](int32_t i) { return i >= 0 && i < int32_t(states); };
+    auto is_target = [states](int32_t i) { return i >= CSP_REFUSE && i < int32_t(states); };
+    size_t slots = image.words(CSP_IMAGE_SLOTS);
+    auto is_slot = [slots](int32_t i) { return i >= -1 && i < int32_t(slots); };
+
+    for (int section : { CSP_IMAGE_EVENTS, CSP_IMAGE_SLOTS, CSP_IMAGE_COMPONENTS })
+        for (size_t i = 0; i < image.words(section); ++i)
+            if (!is_string(image.section(section)[i]))
+                return false;
+
+    size_t prefixes = image.words(CSP_IMAGE_PREFIXES) / (sizeof(CSP_ImagePrefix) / sizeof(int32_t));
+    size_t components = image.words(CSP_IMAGE_COMPONENTS);
+    size_t processes = image.words(CSP_IMAGE_PROCESSES) / (sizeof(CSP_ImageProcess) / sizeof(int32_t));
+    auto process = reinterpret_cast<const CSP_ImageProcess*>(image.section(CSP_IMAGE_PROCESSES));
+    for (size_t i = 0; i < processes; ++i)
+    {
+        const CSP_ImageProcess& p = process[i];
+        if (p.name < 0 || !is_string(p.name) || !is_state(p.first_state)
+            || p.state_count < 1 || size_t(p.first_state) + p.state_count > states
+            || p.first_prefix < 0 || p.prefix_count < 0 || size_t(p.first_prefix) + p.prefix_count > prefixes
+            || p.first_component < 0 || p.component_count < 0 || size_t(p.first_component) + p.component_count > components)
+            return false;
+    }
+    // the prefixes of a process are recompiled once it is merged into, so
+    // their states must be its own
+    auto prefix = reinterpret_cast<const CSP_ImagePrefix*>(image.section(CSP_IMAGE_PREFIXES));
+    for (size_t i = 0; i < processes; ++i)
+        for (int32_t j = process[i].first_prefix; j < process[i].first_prefix + process[i].prefix_count; ++j)
+        {
+            const CSP_ImagePrefix& pre = prefix[j];
+            if (!is_string(pre.event) || !is_string(pre.behavior) || !is_string(pre.out)
+                || pre.from < 0 || pre.from >= process[i].state_count
+                || pre.to < -1 || pre.to >= process[i].state_count || pre.after_ms < 0)
+                return false;
+        }
+
+    // each row lies within the transitions, and is sorted by event
+    size_t transition_count = image.words(CSP_IMAGE_TRANSITIONS) / (sizeof(CSP_Transition) / sizeof(int32_t));
+    const int32_t* state_rows = image.section(CSP_IMAGE_STATE_ROWS);
+    auto transitions = reinterpret_cast<const CSP_Transition*>(image.section(CSP_IMAGE_TRANSITIONS));
+    if (!offsets_valid(state_rows, states, transition_count))
+        return false;
+    for (size_t s = 0; s < states; ++s)
+        for (int32_t t = state_rows[s]; t < state_rows[s + 1]; ++t)
+            if (transitions[t].event < 0 || size_t(transitions[t].event) >= events
+                || (t > state_rows[s] && transitions[t].event <= transitions[t - 1].event)
+                || transitions[t].edge.target == CSP_REFUSE
+                || !is_target(transitions[t].edge.target) || !is_slot(transitions[t].edge.slot))
+                return false;
+    auto engages = [&](int32_t s, size_t e)
+    {
+        return std::binary_search(transitions + state_rows[s], transitions + state_rows[s + 1],
+                                  CSP_Transition{int(e), CSP_Edge()},
+                                  [](const CSP_Transition& a, const CSP_Transition& b) { return a.event < b.event; });
+    };
+
+    // each state lies within its process, and a timeout leads somewhere
+    const int32_t* state_process = image.section(CSP_IMAGE_STATE_PROCESS);
+    const int32_t* timeouts = image.section(CSP_IMAGE_TIMEOUTS);
+    for (size_t i = 0; i < states; ++i)
+    {
+        if (state_process[i] < 0 || size_t(state_process[i]) >= processes)
+            return false;
+        const CSP_ImageProcess& p = process[state_process[i]];
+        if (int32_t(i) < p.first_state || int32_t(i) >= p.first_state + p.state_count
+            || timeouts[3 * i] < 0 || !is_target(timeouts[3 * i + 1]) || !is_slot(timeouts[3 * i + 2])
+            || (timeouts[3 * i] && timeouts[3 * i + 1] == CSP_REFUSE))
+            return false;
+    }
+
+    // the rows of states, and the states they hold
+    for (auto section : { std::make_pair(CSP_IMAGE_EVENT_STATES, events), std::make_pair(CSP_IMAGE_STATE_FORKS, states),
+                          std::make_pair(CSP_IMAGE_PARTICIPANT_STATES, participants),
+                          std::make_pair(CSP_IMAGE_GROUP_STATES, groups) })
+    {
+        const int32_t* rows = image.section(section.first);
+        size_t n = section.second;
+        size_t indices = image.words(section.first) - (n + 1);
+        if (!offsets_valid(rows, n, indices))
+            return false;
+        for (size_t i = 0; i < indices; ++i)
+            if (!is_state(rows[n + 1 + i]))
+                return false;
+    }
+    const int32_t* event_states = image.section(CSP_IMAGE_EVENT_STATES);
+    for (size_t e = 0; e < events; ++e)
+        for (int32_t i = event_states[e]; i < event_states[e + 1]; ++i)
+            if (!engages(event_states[events + 1 + i], e))
+                return false;
+
+    // each state has the one bit, within the words of its group, and each
+    // padding bit is clear in the bitsets
+    const int32_t* state_group = image.section(CSP_IMAGE_STATE_GROUP);
+    const int32_t* event_group = image.section(CSP_IMAGE_EVENT_GROUP);
+    const int32_t* state_bit = image.section(CSP_IMAGE_STATE_BIT);
+    const int32_t* bit_state = image.section(CSP_IMAGE_BIT_STATE);
+    for (size_t s = 0; s < states; ++s)
+    {
+        int32_t g = state_group[s];
+        if (g < 0 || size_t(g) >= groups
+            || state_bit[s] < int64_t(64) * group_words[g] || state_bit[s] >= int64_t(64) * group_words[g + 1]
+            || bit_state[state_bit[s]] != int32_t(s))
+            return false;
+    }
+    for (size_t b = 0; b < bits; ++b)
+        if (bit_state[b] < -1
+            || (bit_state[b] >= 0 && (!is_state(bit_state[b]) || size_t(state_bit[bit_state[b]]) != b)))
+            return false;
+    const int32_t* group_states = image.section(CSP_IMAGE_GROUP_STATES);
+    for (size_t g = 0; g < groups; ++g)
+        for (int32_t i = group_states[g]; i < group_states[g + 1]; ++i)
+            if (size_t(state_group[group_states[groups + 1 + i]]) != g)
+                return false;
+    auto fork_bits = reinterpret_cast<const uint64_t*>(image.section(CSP_IMAGE_FORK_BITS));
+    auto timed_bits = reinterpret_cast<const uint64_t*>(image.section(CSP_IMAGE_TIMED_BITS));
+    const int32_t* state_forks = image.section(CSP_IMAGE_STATE_FORKS);
+    for (size_t b = 0; b < bits; ++b)
+    {
+        int32_t s = bit_state[b];
+        bool forks = s >= 0 && state_forks[s] < state_forks[s + 1];
+        bool timed = s >= 0 && timeouts[3 * s];
+        if (((fork_bits[b >> 6] >> (b & 63)) & 1) != forks || ((timed_bits[b >> 6] >> (b & 63)) & 1) != timed)
+            return false;
+    }
+
+    // a group holds its processes whole, with the states they lead to or
+    // start, and the states calling the same outputs
+    std::vector<int32_t> slot_group(slots, -1);
+    auto same_group = [&](int32_t s, int32_t target) { return target < 0 || state_group[target] == state_group[s]; };
+    auto share_slot = [&](int32_t s, int32_t slot)
+    {
+        if (slot < 0)
+            return true;
+        if (slot_group[slot] < 0)
+            slot_group[slot] = state_group[s];
+        return slot_group[slot] == state_group[s];
+    };
+    for (size_t i = 0; i < states; ++i)
+    {
+        int32_t s = int32_t(i);
+        if (!same_group(s, process[state_process[s]].first_state)
+            || !same_group(s, timeouts[3 * s + 1]) || !share_slot(s, timeouts[3 * s + 2]))
+            return false;
+        for (int32_t t = state_rows[s]; t < state_rows[s + 1]; ++t)
+            if (!same_group(s, transitions[t].edge.target) || !share_slot(s, transitions[t].edge.slot))
+                return false;
+        for (int32_t f = state_forks[s]; f < state_forks[s + 1]; ++f)
+            if (!same_group(s, state_forks[states + 1 + f]))
+                return false;
+    }
+
+    // the states an event touches, those its mask holds and those its syncs
+    // refuse, lie in the event's group, and dispatch takes the transition
+    // of each state the mask holds
+    const int32_t* first_word = image.section(CSP_IMAGE_EVENT_FIRST_WORD);
+    const int32_t* mask_rows = image.section(CSP_IMAGE_EVENT_MASK_ROWS);
+    auto mask_words = reinterpret_cast<const uint64_t*>(image.section(CSP_IMAGE_MASK_WORDS));
+    const int32_t* participant_states = image.section(CSP_IMAGE_PARTICIPANT_STATES);
+    if (!offsets_valid(mask_rows, events, image.words(CSP_IMAGE_MASK_WORDS) / 2))
+        return false;
+    for (size_t e = 0; e < events; ++e)
+    {
+        int32_t g = event_group[e];
+        if (g < -1 || g >= int32_t(groups))
+            return false;
+        int32_t count = mask_rows[e + 1] - mask_rows[e];
+        if (count && (g < 0 || first_word[e] < group_words[g] || int64_t(first_word[e]) + count > group_words[g + 1]))
+            return false;
+        for (int32_t w = 0; w < count; ++w)
+            for (uint64_t word = mask_words[mask_rows[e] + w]; word; word &= word - 1)
+            {
+                int32_t b = 64 * (first_word[e] + w);
+#if defined(__GNUC__)
+                b += __builtin_ctzll(word);
+#else
+                while (!((word >> (b & 63)) & 1))
+                    ++b;
+#endif
+                if (bit_state[b] < 0 || !engages(bit_state[b], e))
+                    return false;
+            }
+        for (int32_t i = sync_participants[event_syncs[e]]; i < sync_participants[event_syncs[e + 1]]; ++i)
+            for (int32_t j = participant_states[i]; j < participant_states[i + 1]; ++j)
+                if (g < 0 || state_group[participant_states[participants + 1 + j]] != g)
+                    return false;
+    }
+
+    // a priority declaration, kind 0, or a coalescing one, kind 1
+    const int32_t* decls = image.section(CSP_IMAGE_DECLS);
+    for (size_t i = 0; i < image.words(CSP_IMAGE_DECLS); i += 3)
+    {
+        int32_t values = decls[i] ? int32_t(CSP_COALESCE_MODE_COUNT) : int32_t(CSP_PRIORITY_COUNT);
+        if (decls[i] < 0 || decls[i] > 1 || decls[i + 1] < 0 || !is_string(decls[i + 1])
+            || decls[i + 2] < 0 || decls[i + 2] >= values)
+            return false;
+    }
+    return true;
+}
+
+// recreate the processes of an image, for csp_load_processes
+void csp_image_processes(const CSP_Image& image, CSP* csp)
+{
+    size_t count = image.words(CSP_IMAGE_PROCESSES) / (sizeof(CSP_ImageProcess) / sizeof(int32_t));
+    auto process = reinterpret_cast<const CSP_ImageProcess*>(image.section(CSP_IMAGE_PROCESSES));
+    auto prefix = reinterpret_cast<const CSP_ImagePrefix*>(image.section(CSP_IMAGE_PREFIXES));
+    const int32_t* component = image.section(CSP_IMAGE_COMPONENTS);
+    for (size_t i = 0; i < count; ++i)
+    {
+        const CSP_ImageProcess& ip = process[i];
+        CSP_Process* p = new CSP_Process();
+        p->name = image.string(ip.name);
+        p->state_count = ip.state_count;
+        p->first_state = ip.first_state;
+        for (int32_t j = ip.first_prefix; j < ip.first_prefix + ip.prefix_count; ++j)
+        {
+            CSP_Prefix pre;
+            pre.from = prefix[j].from;
+            pre.event = image.string(prefix[j].event);
+            pre.after_ms = prefix[j].after_ms;
+            pre.behavior = image.string(prefix[j].behavior);
+            pre.to = prefix[j].to;
+            pre.out = image.string(prefix[j].out);
+            p->prefixes.push_back(std::move(pre));
+        }
+        for (int32_t j = ip.first_component; j < ip.first_component + ip.component_count; ++j)
+            p->components.push_back(image.string(component[j]));
+        csp->processes.emplace_back(std::unique_ptr<CSP_Process>(p));
+    }
+}
+
+// Load an image written by csp_save_image, returning nullptr if there is
+// none, or it is invalid, or it was compiled from a different source. The
+// processes start in their initial states, as from csp_parse.
+CSP* csp_load_image(char const*const path, char const*const src, size_t len)
+{
+    if (!path || !src)
+        return nullptr;
+
+    CSP_Image image;
+    image.mapping = csp_map_file(path);
+    if (!image.mapping)
+        return nullptr;
+    image.header = reinterpret_cast<const CSP_ImageHeader*>(image.mapping->data);
+    if (!csp_image_valid(image, csp_source_hash(src, len)))
+        return nullptr;
+
+    size_t events_compiled = image.header->event_count;
+    size_t states = image.header->state_count;
+    CSP* csp = new CSP();
+    CSP_Program* program = new CSP_Program();
+    auto alphabet = std::make_shared<CSP_Alphabet>();
+    auto tables = std::make_shared<CSP_Tables>();
+
+    // events and slots are interned in order, so a name repeated would
+    // shift the ids of those after it
+    bool repeated = false;
+    const int32_t* events = image.section(CSP_IMAGE_EVENTS);
+    for (size_t i = 0; i < events_compiled; ++i)
+        repeated |= csp_intern_event(alphabet.get(), image.string(events[i])) != int(i);
+    const int32_t* slots = image.section(CSP_IMAGE_SLOTS);
+    {
+        std::lock_guard<std::mutex> binding(csp->slot_mutex);
+        for (size_t i = 0; i < image.words(CSP_IMAGE_SLOTS); ++i)
+            repeated |= csp_intern_slot(csp, image.string(slots[i])) != int(i);
+    }
+    if (repeated)
+    {
+        delete program;
+        delete csp;
+        return nullptr;
+    }
+
+    // the tables view the mapping, which they keep alive
+    size_t syncs = image.words(CSP_IMAGE_SYNC_PARTICIPANTS) - 1;
+    size_t participants = size_t(image.section(CSP_IMAGE_SYNC_PARTICIPANTS)[syncs]);
+    size_t groups = image.words(CSP_IMAGE_GROUP_WORDS) - 1;
+    tables->image = image.mapping;
+    tables->compiled_events = events_compiled;
+    tables->transitions = {image.array<int>(CSP_IMAGE_STATE_ROWS), image.array<CSP_Transition>(CSP_IMAGE_TRANSITIONS)};
+    csp_index_branches(tables.get());
+    tables->state_process = image.array<int>(CSP_IMAGE_STATE_PROCESS);
+    tables->state_timeouts = image.array<CSP_Timeout>(CSP_IMAGE_TIMEOUTS);
+    tables->event_states = image.rows(CSP_IMAGE_EVENT_STATES, events_compiled);
+    tables->state_forks = image.rows(CSP_IMAGE_STATE_FORKS, states);
+    tables->event_syncs = image.array<int>(CSP_IMAGE_EVENT_SYNCS);
+    tables->sync_participants = image.array<int>(CSP_IMAGE_SYNC_PARTICIPANTS);
+    tables->participant_states = image.rows(CSP_IMAGE_PARTICIPANT_STATES, participants);
+    tables->group_states = image.rows(CSP_IMAGE_GROUP_STATES, groups);
+    tables->state_group = image.array<int>(CSP_IMAGE_STATE_GROUP);
+    tables->event_group = image.array<int>(CSP_IMAGE_EVENT_GROUP);
+    tables->state_bit = image.array<int>(CSP_IMAGE_STATE_BIT);
+    tables->bit_state = image.array<int>(CSP_IMAGE_BIT_STATE);
+    tables->group_words = image.array<int>(CSP_IMAGE_GROUP_WORDS);
+    tables->event_first_word = image.array<int>(CSP_IMAGE_EVENT_FIRST_WORD);
+    tables->event_masks = {image.array<int>(CSP_IMAGE_EVENT_MASK_ROWS), image.array<uint64_t>(CSP_IMAGE_MASK_WORDS)};
+    tables->fork_bits = image.array<uint64_t>(CSP_IMAGE_FORK_BITS);
+    tables->timed_bits = image.array<uint64_t>(CSP_IMAGE_TIMED_BITS);
+    tables->state_family.assign(states, -1);
+    tables->event_families.resize(events_compiled);
+    tables->group_families.resize(groups);
+
+    size_t count = image.words(CSP_IMAGE_PROCESSES) / (sizeof(CSP_ImageProcess) / sizeof(int32_t));
+    auto process = reinterpret_cast<const CSP_ImageProcess*>(image.section(CSP_IMAGE_PROCESSES));
+    std::vector<size_t> process_keys(count);
+    for (size_t i = 0; i < count; ++i)
+        process_keys[i] = std::hash<std::string_view>()(image.view(process[i].name));
+    tables->process_keys = std::move(process_keys);
+    program->event_coalesced.resize(events_compiled);
+    program->alphabet = alphabet;
+    program->tables = tables;
+
+    const int32_t* decls = image.section(CSP_IMAGE_DECLS);
+    for (size_t i = 0; i < image.words(CSP_IMAGE_DECLS); i += 3)
+    {
+        auto& d = decls[i] ? csp->event_coalesce_decls : csp->event_priority_decls;
+        d[image.string(decls[i + 1])] = decls[i + 2];
+    }
+    csp_apply_decls(csp, program);
+    delete csp->program.exchange(program);
+
+    size_t words = tables->bit_state.size() / 64;
+    csp->state_active.assign(words, 0);
+    csp->state_pending.assign(words, 0);
+    csp->state_refused.assign(words, 0);
+    csp->state_timers.assign(states, 0);
+    char const* chars = reinterpret_cast<char const*>(image.section(CSP_IMAGE_STRING_CHARS));
+    const int32_t* offsets = image.section(CSP_IMAGE_STRING_OFFSETS);
+    for (size_t i = 0; i < count; ++i)
+    {
+        int32_t name = process[i].name;
+        if (offsets[name] == offsets[name + 1] || chars[offsets[name]] != '_')
+            csp_set_bit(csp->state_pending, tables->state_bit[process[i].first_state]);
+    }
+    csp_promote(csp);
+
+    csp->load_processes = [image](CSP* csp) { csp_image_processes(image, csp); };
+    return csp;
+}
+
+// Write an image of csp, which must have been parsed from src, returning
+// false if it could not be written, or if csp has indexed families, which
+// images have no tables for yet. The image is written beside path and
+// then moved into place, so that a concurrent load never sees it partial.
+bool csp_save_image(CSP* csp, char const*const path, char const*const src, size_t len)
+{
+    if (!csp || !path || !src)
+        return false;
+
+    std::lock_guard<std::mutex> publishing(csp->publish_mutex);
+    std::unique_lock<std::mutex> lock(csp->process_data_mutex);
+    csp_load_processes(csp);
+    const CSP_Program* program = csp_program(csp);
+
+    if (!program->tables->families.empty())
+        return false;
+
+    std::vector<int32_t> sections[CSP_IMAGE_SECTION_COUNT];
+    std::map<std::string, int32_t, std::less<>> string_ids;
+    std::vector<const std::string*> strings;
+    auto intern = [&](const std::string& str) -> int32_t
+    {
+        if (str.empty())
+            return -1;
+        auto it = string_ids.find(str);
+        if (it != string_ids.end())
+            return it->second;
+        int32_t id = int32_t(strings.size());
+        strings.push_back(&string_ids.emplace(str, id).first->first);
+        return id;
+    };
+
+    // events added by csp_add_events since the last compile have no column
+    // in the tables, and are added again by whatever added them
+    for (size_t i = 0; i < program->tables->compiled_events; ++i)
+        sections[CSP_IMAGE_EVENTS].push_back(intern(program->alphabet->names[i]));
+
+    std::vector<std::string> slot_names;
+    {
+        std::lock_guard<std::mutex> binding(csp->slot_mutex);
+        slot_names.resize(csp->lambda_slots.size());
+        for (auto& i : csp->lambda_slots)
+            slot_names[i.second] = i.first;
+    }
+    for (auto& name : slot_names)
+        sections[CSP_IMAGE_SLOTS].push_back(intern(name));
+
+    for (auto& p : csp->processes)
+    {
+        CSP_ImageProcess ip = { intern(p->name), p->first_state, p->state_count,
+            int32_t(sections[CSP_IMAGE_PREFIXES].size() / (sizeof(CSP_ImagePrefix) / sizeof(int32_t))),
+            int32_t(p->prefixes.size()),
+            int32_t(sections[CSP_IMAGE_COMPONENTS].size()), int32_t(p->components.size()) };
+        const int32_t* words = reinterpret_cast<const int32_t*>(&ip);
+        sections[CSP_IMAGE_PROCESSES].insert(sections[CSP_IMAGE_PROCESSES].end(), words, words + sizeof(ip) / sizeof(int32_t));
+
+        for (auto& pre : p->prefixes)
+        {
+            CSP_ImagePrefix ipre = { pre.from, intern(pre.event), pre.after_ms, intern(pre.behavior), pre.to, intern(pre.out) };
+            words = reinterpret_cast<const int32_t*>(&ipre);
+            sections[CSP_IMAGE_PREFIXES].insert(sections[CSP_IMAGE_PREFIXES].end(), words, words + sizeof(ipre) / sizeof(int32_t));
+        }
+        for (auto& name : p->components)
+            sections[CSP_IMAGE_COMPONENTS].push_back(intern(name));
+    }
+
+    // the tables are written as they are laid out in memory
+    const CSP_Tables* tables = program->tables.get();
+    auto put = [&](int section, auto& array)
+    {
+        size_t first = sections[section].size();
+        sections[section].resize(first + array.size() * sizeof(array[0]) / sizeof(int32_t));
+        if (!array.empty())
+            memcpy(sections[section].data() + first, array.data(), array.size() * sizeof(array[0]));
+    };
+    auto put_rows = [&](int section, auto& rows)
+    {
+        put(section, rows.offsets);
+        put(section, rows.values);
+    };
+    put(CSP_IMAGE_STATE_ROWS, tables->transitions.offsets);
+    put(CSP_IMAGE_TRANSITIONS, tables->transitions.values);
+    put(CSP_IMAGE_STATE_PROCESS, tables->state_process);
+    put(CSP_IMAGE_TIMEOUTS, tables->state_timeouts);
+    put_rows(CSP_IMAGE_EVENT_STATES, tables->event_states);
+    put_rows(CSP_IMAGE_STATE_FORKS, tables->state_forks);
+    put(CSP_IMAGE_EVENT_SYNCS, tables->event_syncs);
+    put(CSP_IMAGE_SYNC_PARTICIPANTS, tables->sync_participants);
+    put_rows(CSP_IMAGE_PARTICIPANT_STATES, tables->participant_states);
+    put_rows(CSP_IMAGE_GROUP_STATES, tables->group_states);
+    put(CSP_IMAGE_STATE_GROUP, tables->state_group);
+    put(CSP_IMAGE_EVENT_GROUP, tables->event_group);
+    put(CSP_IMAGE_STATE_BIT, tables->state_bit);
+    put(CSP_IMAGE_BIT_STATE, tables->bit_state);
+    put(CSP_IMAGE_GROUP_WORDS, tables->group_words);
+    put(CSP_IMAGE_EVENT_FIRST_WORD, tables->event_first_word);
+    put(CSP_IMAGE_EVENT_MASK_ROWS, tables->event_masks.offsets);
+    put(CSP_IMAGE_MASK_WORDS, tables->event_masks.values);
+    put(CSP_IMAGE_FORK_BITS, tables->fork_bits);
+    put(CSP_IMAGE_TIMED_BITS, tables->timed_bits);
+
+    for (auto& i : csp->event_priority_decls)
+        sections[CSP_IMAGE_DECLS].insert(sections[CSP_IMAGE_DECLS].end(), { 0, intern(i.first), i.second });
+    for (auto& i : csp->event_coalesce_decls)
+        sections[CSP_IMAGE_DECLS].insert(sections[CSP_IMAGE_DECLS].end(), { 1, intern(i.first), i.second });
+
+    // the string table goes last, once every string has been interned
+    std::string chars;
+    for (auto str : strings)
+    {
+        sections[CSP_IMAGE_STRING_OFFSETS].push_back(int32_t(chars.size()));
+        chars += *str;
+    }
+    sections[CSP_IMAGE_STRING_OFFSETS].push_back(int32_t(chars.size()));
+    chars.resize((chars.size() + sizeof(int32_t) - 1) / sizeof(int32_t) * sizeof(int32_t));
+    sections[CSP_IMAGE_STRING_CHARS].resize(chars.size() / sizeof(int32_t));
+    if (!chars.empty())
+        memcpy(sections[CSP_IMAGE_STRING_CHARS].data(), chars.data(), chars.size());
+
+    CSP_ImageHeader header = {};
+    header.magic = CSP_IMAGE_MAGIC;
+    header.version = CSP_IMAGE_VERSION;
+    header.source_hash = csp_source_hash(src, len);
+    header.event_count = uint32_t(program->tables->compiled_events);
+    header.state_count = uint32_t(program->tables->state_process.size());
+    // every section starts on a 64 bit boundary, so that those of 64 bit
+    // words can be read in place
+    uint32_t offset = 0;
+    for (int i = 0; i < CSP_IMAGE_SECTION_COUNT; ++i)
+    {
+        header.sections[i][0] = offset;
+        header.sections[i][1] = uint32_t(sections[i].size());
+        offset += uint32_t(sections[i].size() + 1) / 2 * 2;
+    }
+    lock.unlock();
+
+    std::string temp = std::string(path) + ".tmp";
+    FILE* f = fopen(temp.c_str(), "wb");
+    if (!f)
+        return false;
+    bool written = fwrite(&header, sizeof(header), 1, f) == 1;
+    for (int i = 0; i < CSP_IMAGE_SECTION_COUNT && written; ++i)
+    {
+        if (sections[i].size() % 2)
+            sections[i].push_back(0);
+        if (!sections[i].empty())
+            written = fwrite(sections[i].data(), sizeof(int32_t), sections[i].size(), f) == sections[i].size();
+    }
+    written = fclose(f) == 0 && written;
+#if defined(_WIN32)
+    if (written)
+        remove(path);
+#endif
+    if (!written || rename(temp.c_str(), path) != 0)
+    {
+        remove(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Load the image at path if it is current for src, and otherwise parse src
+// and write its image for next time.
+CSP* csp_parse_cached(char const*const path, char const*const src, size_t len)
+{
+    CSP* csp = csp_load_image(path, src, len);
+    if (csp)
+        return csp;
+
+    csp = csp_parse(nullptr, src, len);
+    csp_save_image(csp, path, src, len);
+    return csp;
+}
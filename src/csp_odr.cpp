@@ -12,22 +12,35 @@ char* csp_src = R"csp(
 int main() try
 {
     CSP* csp = csp_parse(nullptr, csp_src, strlen(csp_src));
-    std::cout << "Parsed " << csp->processes.size() << " processes\n";
+    std::cout << "Parsed " << csp->processes.size() << " processes, "
+              << csp_program(csp)->tables->state_process.size() << " states\n";
     for (auto& i : csp->processes)
     {
-        std::cout << i->name << " = (" << i->event << " -> " << i->behavior;
-        if (i->out.length())
-            std::cout << " \"" << i->out << "\"";
-        std::cout << ")\n";
+        for (auto& prefix : i->prefixes)
+        {
+            std::cout << i->name;
+            if (prefix.from)
+                std::cout << "." << prefix.from;
+            std::cout << ": " << prefix.event << " -> ";
+            if (prefix.to >= 0)
+                std::cout << i->name << "." << prefix.to;
+            else
+                std::cout << prefix.behavior;
+            if (prefix.out.length())
+                std::cout << " \"" << prefix.out << "\"";
+            std::cout << "\n";
+        }
     }
-    csp_bind_lambda(csp, "ticked", [](){printf("tick\n");});
-    csp_bind_lambda(csp, "clock2_tocked", [](){printf("tock\n");});
-    csp_emit(csp, "tick");
-    csp_emit(csp, "foo");
-    csp_emit(csp, "tock");
-    csp_emit(csp, "tick");
-    csp_emit(csp, "tock");
+    csp_bind_lambda(csp, "ticked", [](int){printf("tick\n");});
+    csp_bind_lambda(csp, "clock2_tocked", [](int){printf("tock\n");});
+    csp_emit(csp, "tick", 0);
+    csp_emit(csp, "foo", 0);
+    csp_emit(csp, "tock", 0);
+    csp_emit(csp, "tick", 0);
+    csp_emit(csp, "tock", 0);
     csp_update(csp);
+    for (auto& i : csp_dead_letters(csp))
+        std::cout << "Dead letters: " << i.first << " " << i.second << "\n";
     return 0;
 }
 catch(std::exception& exc)
@@ -0,0 +1,407 @@
+#pragma once
+
+#include "csp.h"
+
+// A process set split across several csps, each dispatched by a thread of
+// its own, so that event throughput scales with cores rather than with one
+// dispatcher. Processes are split along the independent groups of
+// csp_group, so that no event, output, or behavior spans two shards, and
+// every event is routed to the shards whose processes engage in it.
+//
+// Events emitted with csp_shards_emit from a shard's own thread, as from
+// its lambdas, travel to other shards over a channel per pair of shards,
+// with a single producer and a single consumer. Channel events are
+// dispatched in the order they were sent, bypassing the priority lanes,
+// capacity, and coalescing of the receiving shard. Events emitted from any
+// other thread are queued on the shard as by csp_emit.
+
+// the number of events in each block of a channel
+constexpr size_t CSP_CHANNEL_BLOCK = 256;
+
+// An unbounded queue of events from the thread of one shard to another's,
+// as a list of blocks. The producer appends to the last block, and the
+// consumer reads from the first, freeing each block once it has read it all.
+struct CSP_Channel
+{
+    struct Block
+    {
+        CSP_Event events[CSP_CHANNEL_BLOCK];
+        std::atomic<size_t> count{0};
+        std::atomic<Block*> next{nullptr};
+    };
+
+    CSP_Channel() : head(new Block()), tail(head) {}
+    ~CSP_Channel()
+    {
+        while (head)
+        {
+            Block* next = head->next.load();
+            delete head;
+            head = next;
+        }
+    }
+
+    CSP_Channel(const CSP_Channel&) = delete;
+    CSP_Channel& operator=(const CSP_Channel&) = delete;
+
+    // producer only
+    void push(const CSP_Event& event)
+    {
+        size_t n = tail->count.load(std::memory_order_relaxed);
+        if (n == CSP_CHANNEL_BLOCK)
+        {
+            Block* block = new Block();
+            tail->next.store(block, std::memory_order_release);
+            tail = block;
+            n = 0;
+        }
+        tail->events[n] = event;
+        tail->count.store(n + 1, std::memory_order_release);
+        pushed.fetch_add(1);
+    }
+
+    // consumer only; appends the events sent so far to out
+    void pop_all(std::vector<CSP_Event>& out)
+    {
+        size_t first = out.size();
+        while (true)
+        {
+            size_t n = head->count.load(std::memory_order_acquire);
+            for (; read < n; ++read)
+                out.push_back(std::move(head->events[read]));
+            if (read < CSP_CHANNEL_BLOCK)
+                break;
+            Block* next = head->next.load(std::memory_order_acquire);
+            if (!next)
+                break;
+            delete head;
+            head = next;
+            read = 0;
+        }
+        popped.fetch_add(out.size() - first);
+    }
+
+    // may report events that the consumer has already taken, but never
+    // misses events pushed before the call
+    bool empty() const { return pushed.load() == popped.load(); }
+
+    Block* head;            // consumer side
+    size_t read = 0;
+    Block* tail;            // producer side
+    std::atomic<uint64_t> pushed{0};
+    std::atomic<uint64_t> popped{0};
+};
+
+struct CSP_Shard
+{
+    CSP* csp = nullptr;
+    std::thread thread;
+    std::vector<CSP_Event> received;        // scratch for csp_shard_receive
+    std::atomic<uint64_t> passes{0};        // see csp_shards_wait_idle
+};
+
+struct CSP_Shards;
+void csp_stop_shards(CSP_Shards* shards);
+
+struct CSP_Shards
+{
+    ~CSP_Shards()
+    {
+        csp_stop_shards(this);
+        for (auto& shard : shards)
+            delete shard->csp;
+    }
+
+    std::vector<std::unique_ptr<CSP_Shard>> shards;
+    std::vector<std::unique_ptr<CSP_Channel>> channels;    // [from * shard count + to]
+
+    // the events of every shard, interned to ids of their own, and for each
+    // id, the shards engaging in it with the event's id on that shard
+    std::map<std::string, int, std::less<>> event_ids;
+    std::vector<std::vector<std::pair<int, int>>> routes;
+
+    std::atomic<bool> run{false};
+    std::atomic<uint64_t> unrouted{0};      // events no shard engages in
+};
+
+struct CSP_ShardThread
+{
+    const CSP_Shards* shards = nullptr;
+    int index = -1;
+};
+
+CSP_ShardThread& csp_shard_thread()
+{
+    thread_local CSP_ShardThread thread;
+    return thread;
+}
+
+// the shard of shards whose thread is calling, or -1
+int csp_current_shard(const CSP_Shards* shards)
+{
+    const CSP_ShardThread& thread = csp_shard_thread();
+    return thread.shards == shards ? thread.index : -1;
+}
+
+CSP_Channel& csp_channel(CSP_Shards* shards, int from, int to)
+{
+    return *shards->channels[from * shards->shards.size() + to];
+}
+
+// Parse src and split its processes between count shards, balancing their
+// states. The processes of a group stay together, so there may be fewer
+// busy shards than count. The declarations in src apply to every shard.
+// Returns nullptr if src doesn't parse, or a composition names a component
+// that isn't an ordinary process. The shards don't dispatch until
+// csp_start_shards.
+CSP_Shards* csp_shards_parse(char const*const src, size_t len, size_t count)
+{
+    if (!src || !count)
+        return nullptr;
+
+    std::vector<std::unique_ptr<CSP_Process>> processes;
+    std::map<std::string, int, std::less<>> priority_decls;
+    std::map<std::string, int, std::less<>> coalesce_decls;
+    if (!csp_parse_source(src, len, processes, priority_decls, coalesce_decls) || !csp_check_components(processes))
+        return nullptr;
+
+    // compile the whole set once, to find its groups
+    std::map<std::string, int, std::less<>> slots;
+    for (auto& p : processes)
+        for (auto& prefix : p->prefixes)
+            if (!prefix.out.empty())
+                slots.insert({prefix.out, int(slots.size())});
+    CSP_Program empty;
+    std::unique_ptr<CSP_Program> program(csp_compile(processes, &empty, slots));
+
+    // the largest groups first, each to the shard with the fewest states,
+    // counting each instance of a family as a state
+    std::vector<int> groups(program->tables->group_states.size());
+    std::vector<size_t> weight(groups.size());
+    for (int g = 0; g < int(groups.size()); ++g)
+    {
+        groups[g] = g;
+        weight[g] = program->tables->group_states[g].size();
+        for (int f : program->tables->group_families[g])
+            weight[g] += program->tables->families[f].instances;
+    }
+    std::stable_sort(groups.begin(), groups.end(), [&weight](int a, int b)
+    {
+        return weight[a] > weight[b];
+    });
+    std::vector<size_t> load(count, 0);
+    std::vector<int> group_shard(groups.size());
+    for (int g : groups)
+    {
+        int shard = int(std::min_element(load.begin(), load.end()) - load.begin());
+        group_shard[g] = shard;
+        load[shard] += weight[g];
+    }
+
+    std::vector<std::vector<std::unique_ptr<CSP_Process>>> split(count);
+    for (auto& p : processes)
+        split[group_shard[program->tables->state_group[p->first_state]]].push_back(std::move(p));
+
+    CSP_Shards* shards = new CSP_Shards();
+    for (size_t i = 0; i < count; ++i)
+    {
+        CSP_Shard* shard = new CSP_Shard();
+        shards->shards.emplace_back(shard);
+        shard->csp = new CSP();
+        csp_build(shard->csp, std::move(split[i]), priority_decls, coalesce_decls, false);
+
+        const CSP_Program* shard_program = csp_program(shard->csp);
+        for (size_t event = 0; event < shard_program->tables->event_group.size(); ++event)
+        {
+            if (shard_program->tables->event_group[event] < 0)
+                continue;
+            auto it = shards->event_ids.insert({shard_program->alphabet->names[event], int(shards->routes.size())}).first;
+            if (size_t(it->second) == shards->routes.size())
+                shards->routes.emplace_back();
+            shards->routes[it->second].push_back({int(i), int(event)});
+        }
+    }
+    for (size_t i = 0; i < count * count; ++i)
+        shards->channels.emplace_back(new CSP_Channel());
+    return shards;
+}
+
+// returns the id of a named event for csp_shards_emit, or -1 if no shard
+// engages in it
+int csp_shards_find_event(CSP_Shards* shards, char const*const name)
+{
+    if (!shards || !name)
+        return -1;
+
+    auto it = shards->event_ids.find(name);
+    return it == shards->event_ids.end() ? -1 : it->second;
+}
+
+// Send an event to every shard engaging in it. Returns false if no shard
+// does, or if a shard's lanes had no room for it.
+bool csp_shards_emit(CSP_Shards* shards, int event, int id, const CSP_Payload& payload = {})
+{
+    if (!shards)
+        return false;
+    if (event < 0 || size_t(event) >= shards->routes.size())
+    {
+        shards->unrouted.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    int from = csp_current_shard(shards);
+    bool queued = true;
+    for (auto& route : shards->routes[event])
+    {
+        CSP* csp = shards->shards[route.first]->csp;
+        if (from < 0 || from == route.first)
+        {
+            queued &= csp_emit(csp, route.second, id, payload);
+            continue;
+        }
+        csp_channel(shards, from, route.first).push(CSP_Event{route.second, id, payload});
+        csp_signal(csp);
+    }
+    return queued;
+}
+
+bool csp_shards_emit(CSP_Shards* shards, char const*const name, int id, const CSP_Payload& payload = {})
+{
+    return csp_shards_emit(shards, csp_shards_find_event(shards, name), id, payload);
+}
+
+// bind a lambda on the shard whose processes output name. Returns false if
+// none do.
+bool csp_shards_bind_lambda(CSP_Shards* shards, char const*const name, std::function<void(int)> fn)
+{
+    if (!shards || !name || !fn)
+        return false;
+
+    for (auto& shard : shards->shards)
+    {
+        CSP* csp = shard->csp;
+        bool outputs;
+        {
+            std::lock_guard<std::mutex> binding(csp->slot_mutex);
+            outputs = csp->lambda_slots.count(name) > 0;
+        }
+        if (outputs)
+            return csp_bind_lambda(csp, name, std::move(fn)) >= 0;
+    }
+    return false;
+}
+
+bool csp_shard_inbox_empty(CSP_Shards* shards, int to)
+{
+    for (int from = 0; from < int(shards->shards.size()); ++from)
+        if (from != to && !csp_channel(shards, from, to).empty())
+            return false;
+    return true;
+}
+
+// dispatch the events sent to a shard by the others
+void csp_shard_receive(CSP_Shards* shards, int to)
+{
+    CSP_Shard& shard = *shards->shards[to];
+    for (int from = 0; from < int(shards->shards.size()); ++from)
+        if (from != to)
+            csp_channel(shards, from, to).pop_all(shard.received);
+    if (shard.received.empty())
+        return;
+
+    CSP* csp = shard.csp;
+    std::unique_lock<std::mutex> lock(csp->process_data_mutex);
+    csp->dispatch_thread = std::this_thread::get_id();
+    csp_prepare_batches(csp);
+    for (auto& event : shard.received)
+    {
+        csp_dispatch(csp, event);
+        csp_resume(csp, event);
+    }
+    csp_flush_batches(csp);
+    csp->dispatch_thread = std::thread::id();
+    shard.received.clear();
+}
+
+// the loop of a shard's thread, as csp_dispatcher_run, also woken by its
+// channels
+void csp_shard_run(CSP_Shards* shards, int index)
+{
+    csp_shard_thread() = CSP_ShardThread{shards, index};
+    CSP_Shard& shard = *shards->shards[index];
+    CSP* csp = shard.csp;
+    while (shards->run.load())
+    {
+        csp_update(csp);
+        csp_shard_receive(shards, index);
+        shard.passes.fetch_add(1);
+
+        std::unique_lock<std::mutex> lock(csp->dispatcher_mutex);
+        csp->dispatcher_waiting.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto wake = [shards, index, csp]()
+        {
+            return csp_queued(csp) || !csp_shard_inbox_empty(shards, index) ||
+                   csp->timers_changed.exchange(false) || !shards->run.load();
+        };
+        auto deadline = csp_timer_deadline(csp->timers);
+        if (deadline == CSP_Clock::time_point::max())
+            csp->dispatcher_wake.wait(lock, wake);
+        else
+            csp->dispatcher_wake.wait_until(lock, deadline, wake);
+        csp->dispatcher_waiting.store(false, std::memory_order_relaxed);
+    }
+    csp_shard_thread() = CSP_ShardThread{};
+}
+
+// start a thread per shard, which owns the shard's dispatch from then on
+void csp_start_shards(CSP_Shards* shards)
+{
+    if (!shards || shards->run.exchange(true))
+        return;
+
+    for (int i = 0; i < int(shards->shards.size()); ++i)
+        shards->shards[i]->thread = std::thread([shards, i]() { csp_shard_run(shards, i); });
+}
+
+void csp_stop_shards(CSP_Shards* shards)
+{
+    if (!shards || !shards->run.exchange(false))
+        return;
+
+    for (auto& shard : shards->shards)
+    {
+        {
+            std::lock_guard<std::mutex> lock(shard->csp->dispatcher_mutex);
+            shard->csp->dispatcher_wake.notify_one();
+        }
+        shard->thread.join();
+    }
+}
+
+// Block until every shard is waiting with nothing queued or in its
+// channels, and has stayed so for a pass over all of them, so that events
+// in flight between shards have been dispatched.
+void csp_shards_wait_idle(CSP_Shards* shards)
+{
+    if (!shards || !shards->run.load())
+        return;
+
+    std::vector<uint64_t> passes(shards->shards.size(), ~uint64_t(0));
+    while (true)
+    {
+        bool idle = true;
+        for (int i = 0; i < int(shards->shards.size()); ++i)
+        {
+            CSP_Shard& shard = *shards->shards[i];
+            uint64_t n = shard.passes.load();
+            if (n != passes[i] || !shard.csp->dispatcher_waiting.load() ||
+                csp_queued(shard.csp) || !csp_shard_inbox_empty(shards, i))
+                idle = false;
+            passes[i] = n;
+        }
+        if (idle)
+            return;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}